@@ -0,0 +1,112 @@
+
+#include "arena.h"
+#include "metrics.h"
+
+static const uint32_t kArenaBlockSize = 64 * 1024;
+
+struct arenablock_t {
+	struct arenablock_t *prev;
+	uint32_t size;
+	uint32_t offset;
+};
+
+static uint32_t alignSize(uint32_t size) {
+	return (size + 15) & ~15;
+}
+
+void initArena(struct arena_t *arena) {
+	memset(arena, 0, sizeof(struct arena_t));
+}
+
+void freeArena(struct arena_t *arena) {
+	countScratchPeak(arena->peak);
+	struct arenablock_t *block = arena->block;
+	while (block) {
+		struct arenablock_t *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+	free(arena->spare);
+	initArena(arena);
+}
+
+static bool pushBlock(struct arena_t *arena, uint32_t size) {
+	struct arenablock_t *block = arena->spare;
+	if (block && block->size >= size) {
+		arena->spare = 0;
+	} else {
+		if (size < kArenaBlockSize) {
+			size = kArenaBlockSize;
+		}
+		/* the header is padded so the data stays 16 bytes aligned */
+		block = (struct arenablock_t *)aligned_alloc(16, alignSize(sizeof(struct arenablock_t)) + size);
+		if (!block) {
+			return false;
+		}
+		block->size = size;
+	}
+	block->prev = arena->block;
+	block->offset = 0;
+	arena->block = block;
+	return true;
+}
+
+static uint8_t *blockData(struct arenablock_t *block) {
+	return (uint8_t *)block + alignSize(sizeof(struct arenablock_t));
+}
+
+bool reserveArena(struct arena_t *arena, uint32_t size) {
+	size = alignSize(size);
+	struct arenablock_t *block = arena->block;
+	if (block && block->offset + size <= block->size) {
+		return true;
+	}
+	return pushBlock(arena, size);
+}
+
+void *allocArena(struct arena_t *arena, uint32_t size) {
+	size = alignSize(size);
+	if (!reserveArena(arena, size)) {
+		return 0;
+	}
+	struct arenablock_t *block = arena->block;
+	uint8_t *p = blockData(block) + block->offset;
+	block->offset += size;
+	arena->used += size;
+	if (arena->used > arena->peak) {
+		arena->peak = arena->used;
+	}
+	return p;
+}
+
+void *callocArena(struct arena_t *arena, uint32_t size) {
+	void *p = allocArena(arena, size);
+	if (p) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+void markArena(const struct arena_t *arena, struct arenamark_t *mark) {
+	mark->block = arena->block;
+	mark->offset = arena->block ? arena->block->offset : 0;
+	mark->used = arena->used;
+}
+
+void releaseArena(struct arena_t *arena, const struct arenamark_t *mark) {
+	while (arena->block != mark->block) {
+		struct arenablock_t *block = arena->block;
+		arena->block = block->prev;
+		/* keep the largest block, the same allocations are usually made again */
+		if (!arena->spare || arena->spare->size < block->size) {
+			free(arena->spare);
+			arena->spare = block;
+		} else {
+			free(block);
+		}
+	}
+	if (arena->block) {
+		arena->block->offset = mark->offset;
+	}
+	arena->used = mark->used;
+}
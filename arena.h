@@ -0,0 +1,34 @@
+
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include "intern.h"
+
+struct arenablock_t;
+
+/* bump allocator, memory is only returned with releaseArena and is never moved */
+struct arena_t {
+	struct arenablock_t *block; /* current, linked to the previous ones */
+	struct arenablock_t *spare; /* released block kept for the next allocations */
+	uint32_t used; /* bytes allocated */
+	uint32_t peak;
+};
+
+struct arenamark_t {
+	struct arenablock_t *block;
+	uint32_t offset;
+	uint32_t used;
+};
+
+void initArena(struct arena_t *arena);
+void freeArena(struct arena_t *arena);
+/* returns 'size' bytes aligned on 16 bytes, or 0 */
+void *allocArena(struct arena_t *arena, uint32_t size);
+void *callocArena(struct arena_t *arena, uint32_t size);
+/* makes the next 'size' bytes of allocations contiguous, to be called with the total size of the allocations to come */
+bool reserveArena(struct arena_t *arena, uint32_t size);
+void markArena(const struct arena_t *arena, struct arenamark_t *mark);
+/* releases the allocations made after 'mark' */
+void releaseArena(struct arena_t *arena, const struct arenamark_t *mark);
+
+#endif /* ARENA_H__ */
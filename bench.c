@@ -0,0 +1,555 @@
+
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "decode.h"
+#include "mbk.h"
+#include "rom.h"
+#include "unpack.h"
+
+#define MAX_BLOBS 1024
+#define MAX_LEVELS 8
+
+struct blob_t {
+	const uint8_t *data;
+	int size; /* the packed stream ends at 'data + size' */
+};
+
+struct level_t {
+	char name[32];
+	const uint8_t *lev, *mbk, *pal, *sgd;
+	int rooms;
+};
+
+struct fixture_t {
+	int blobsCount;
+	struct blob_t blobs[MAX_BLOBS];
+	int levelsCount;
+	struct level_t levels[MAX_LEVELS];
+	const uint8_t *spr, *tab;
+};
+
+static double getTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+static void addBlob(struct fixture_t *f, const uint8_t *data, int size) {
+	if (f->blobsCount < MAX_BLOBS) {
+		f->blobs[f->blobsCount].data = data;
+		f->blobs[f->blobsCount].size = size;
+		++f->blobsCount;
+	}
+}
+
+static int countRooms(struct fixture_t *f, const uint8_t *lev) {
+	int count = 0;
+	uint32_t offset_prev = 64 * 4;
+	for (int i = 0; i < 64; ++i) {
+		const uint32_t offset = READ_BE_UINT32(lev + 4 * i);
+		if (offset_prev != 0 && offset != offset_prev) {
+			addBlob(f, lev, offset);
+			++count;
+		}
+		offset_prev = offset;
+	}
+	return count;
+}
+
+/* the entries table has no count, stop at the first entry not pointing to a bank of 'count' tiles */
+static void addMbkBlobs(struct fixture_t *f, const uint8_t *mbk, uint32_t size) {
+	for (uint32_t i = 0; (i + 1) * 6 <= size; ++i) {
+		const uint32_t offset = READ_BE_UINT32(mbk + i * 6);
+		const uint16_t count = READ_BE_UINT16(mbk + i * 6 + 4);
+		if (offset <= (i + 1) * 6 || offset > size) {
+			break;
+		}
+		if ((count & 0x8000) == 0) {
+			if (offset < 16 || READ_BE_UINT32(mbk + offset - 4) != count * 32) {
+				break;
+			}
+			addBlob(f, mbk, offset);
+		}
+	}
+}
+
+static void addLevel(struct fixture_t *f, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd) {
+	if (f->levelsCount < MAX_LEVELS) {
+		struct level_t *l = &f->levels[f->levelsCount++];
+		snprintf(l->name, sizeof(l->name), "%s", name);
+		l->lev = lev;
+		l->mbk = mbk;
+		l->pal = pal;
+		l->sgd = sgd;
+		l->rooms = countRooms(f, lev);
+	}
+}
+
+static void loadRomFixture(struct fixture_t *f, const struct rom_t *rom) {
+	for (int i = 0; i < rom->assetsCount; ++i) {
+		const struct asset_t *asset = &rom->assets[i];
+		const uint8_t *data = rom->data + asset->offset;
+		const char *ext = strchr(asset->name, '.');
+		if (!ext) {
+			continue;
+		}
+		if (strcmp(ext, ".CT") == 0) {
+			addBlob(f, data, asset->size);
+		} else if (strcmp(ext, ".MBK") == 0) {
+			addMbkBlobs(f, data, asset->size);
+		} else if (strcmp(ext, ".LEV") == 0) {
+			char name[40];
+			const int len = ext - asset->name;
+			snprintf(name, sizeof(name), "%.*s.MBK", len, asset->name);
+			const uint8_t *mbk = getAssetData(rom, name);
+			snprintf(name, sizeof(name), "%.*s.PAL", len, asset->name);
+			const uint8_t *pal = getAssetData(rom, name);
+			const uint8_t *sgd = 0;
+			if (strncmp(asset->name, "LEVEL1.", 7) == 0) {
+				sgd = getAssetData(rom, "LEVEL1.SGD");
+			}
+			if (mbk && pal) {
+				addLevel(f, asset->name, data, mbk, pal, sgd);
+			}
+		}
+	}
+	f->spr = getAssetData(rom, "GLOBAL.SPR");
+	f->tab = getAssetData(rom, "GLOBAL.TAB");
+}
+
+/* synthetic fixtures, so the benchmark runs without a ROM */
+
+static uint32_t _seed = 1;
+
+static int rnd(int max) {
+	_seed = _seed * 1103515245 + 12345;
+	return (_seed >> 16) % max;
+}
+
+struct buffer_t {
+	uint8_t *data;
+	int size;
+};
+
+static void putBytes(struct buffer_t *b, const void *data, int size) {
+	memcpy(b->data + b->size, data, size);
+	b->size += size;
+}
+
+static void putBE16(struct buffer_t *b, uint16_t value) {
+	b->data[b->size++] = value >> 8;
+	b->data[b->size++] = value & 255;
+}
+
+static void putBE32(struct buffer_t *b, uint32_t value) {
+	putBE16(b, value >> 16);
+	putBE16(b, value & 0xFFFF);
+}
+
+/* bytekiller stream made of literals only, bits are given in reading order */
+static void packBytes(struct buffer_t *out, const uint8_t *data, int size) {
+	uint8_t *bits = (uint8_t *)malloc(size * 9 + 32);
+	int count = 0;
+	for (int p = size - 1; p >= 0; ) {
+		int len = 1 + rnd(264);
+		if (len > p + 1) {
+			len = p + 1;
+		}
+		const int code = (len <= 8) ? (len - 1) : (0x700 | (len - 9));
+		const int codeBits = (len <= 8) ? 5 : 11;
+		for (int i = codeBits - 1; i >= 0; --i) {
+			bits[count++] = (code >> i) & 1;
+		}
+		for (int i = 0; i < len; ++i, --p) {
+			for (int j = 7; j >= 0; --j) {
+				bits[count++] = (data[p] >> j) & 1;
+			}
+		}
+	}
+	const int first = count % 32;
+	uint32_t word = 1 << first;
+	for (int i = 0; i < first; ++i) {
+		word |= bits[i] << i;
+	}
+	uint32_t crc = word;
+	const int wordsCount = (count - first) / 32;
+	for (int w = wordsCount - 1; w >= 0; --w) {
+		uint32_t value = 0;
+		for (int i = 0; i < 32; ++i) {
+			value |= (uint32_t)bits[first + w * 32 + i] << i;
+		}
+		crc ^= value;
+		putBE32(out, value);
+	}
+	putBE32(out, word);
+	putBE32(out, crc);
+	putBE32(out, size);
+	free(bits);
+}
+
+static void encodeRLE(struct buffer_t *out, const uint8_t *data, int size) {
+	const int start = out->size;
+	putBE16(out, 0);
+	for (int i = 0; i < size; ) {
+		int run = 1;
+		while (i + run < size && run < 128 && data[i + run] == data[i]) {
+			++run;
+		}
+		if (run >= 3) {
+			out->data[out->size++] = (uint8_t)(1 - run);
+			out->data[out->size++] = data[i];
+			i += run;
+		} else {
+			const int len = (size - i < 128) ? size - i : 128;
+			out->data[out->size++] = len - 1;
+			putBytes(out, data + i, len);
+			i += len;
+		}
+	}
+	const int compressedSize = out->size - start - 2;
+	out->data[start] = compressedSize >> 8;
+	out->data[start + 1] = compressedSize & 255;
+}
+
+static const int kSynthBanks = 16;
+static const int kSynthTiles = 32;
+static const int kSynthRooms = 24;
+static const int kSynthShapes = 32;
+static const int kSynthPalettes = 8;
+
+static uint8_t *createSyntheticFixture(struct fixture_t *f) {
+	static const int kBufferSize = 4 << 20;
+	uint8_t *buf = (uint8_t *)malloc(kBufferSize);
+	if (!buf) {
+		return 0;
+	}
+	struct buffer_t b = { buf, 0 };
+	uint8_t tmp[4096];
+
+	/* MBK, 8x8 tiles */
+	const uint8_t *mbk = b.data + b.size;
+	const int mbkStart = b.size;
+	b.size += kSynthBanks * 6;
+	for (int i = 0; i < kSynthBanks; ++i) {
+		uint8_t tiles[kSynthTiles * 32];
+		for (int j = 0; j < kSynthTiles * 32; ++j) {
+			tiles[j] = (j & 4) ? rnd(256) : 0;
+		}
+		packBytes(&b, tiles, sizeof(tiles));
+		struct buffer_t entry = { buf + mbkStart + i * 6, 0 };
+		putBE32(&entry, b.size - mbkStart);
+		putBE16(&entry, kSynthTiles);
+	}
+
+	/* PAL */
+	const uint8_t *pal = b.data + b.size;
+	for (int i = 0; i < kSynthPalettes * 16; ++i) {
+		putBE16(&b, rnd(0x1000));
+	}
+
+	/* SGD, planar bits followed by the mask */
+	const uint8_t *sgd = b.data + b.size;
+	const int sgdStart = b.size;
+	b.size += (kSynthShapes + 1) * 4;
+	for (int i = 0; i < kSynthShapes; ++i) {
+		const int w = 1 + rnd(4);
+		const int h = 1 + rnd(40);
+		const int size = w * 2 * h;
+		tmp[0] = w * 2 - 1;
+		tmp[1] = h - 1;
+		tmp[2] = size >> 8;
+		tmp[3] = size & 255;
+		for (int j = 0; j < size * 5; ++j) {
+			tmp[4 + j] = ((j / 8) & 1) ? 0x11 : rnd(256);
+		}
+		struct buffer_t entry = { buf + sgdStart + i * 4, 0 };
+		putBE32(&entry, b.size - sgdStart);
+		encodeRLE(&b, tmp, 4 + size * 5);
+	}
+	struct buffer_t entry = { buf + sgdStart + kSynthShapes * 4, 0 };
+	putBE32(&entry, b.size - sgdStart);
+
+	/* LEV, the rooms use both tilemap layers or SGD shapes */
+	const uint8_t *lev = b.data + b.size;
+	const int levStart = b.size;
+	b.size += 64 * 4;
+	for (int i = 0; i < 64; ++i) {
+		if (i < kSynthRooms) {
+			struct buffer_t room = { tmp, 16 };
+			const bool shapes = (i & 3) == 3;
+			memset(tmp, 0, 16);
+			tmp[1] = shapes ? 1 : 0;
+			for (int j = 0; j < 4; ++j) {
+				tmp[2 + j * 2 + 1] = rnd(kSynthPalettes);
+			}
+			tmp[14] = room.size >> 8;
+			tmp[15] = room.size & 255;
+			putBE16(&room, 0x8000 | rnd(kSynthBanks));
+			room.data[room.size++] = 255;
+			tmp[10] = room.size >> 8;
+			tmp[11] = room.size & 255;
+			if (shapes) {
+				putBE16(&room, 16);
+				for (int j = 0; j < 16; ++j) {
+					putBE16(&room, rnd(kSynthShapes));
+					putBE16(&room, rnd(256) - 8);
+					putBE16(&room, rnd(224) - 8);
+				}
+			} else {
+				for (int j = 0; j < 32 * 28; ++j) {
+					putBE16(&room, rnd(kSynthTiles + 1) | (rnd(16) << 11));
+				}
+			}
+			tmp[12] = room.size >> 8;
+			tmp[13] = room.size & 255;
+			for (int j = 0; j < 32 * 28; ++j) {
+				const int num = rnd(kSynthTiles + 1);
+				putBE16(&room, ((num != 0 && shapes) ? num + 0x380 : num) | (rnd(16) << 11));
+			}
+			packBytes(&b, tmp, room.size);
+		}
+		struct buffer_t entry = { buf + levStart + i * 4, 0 };
+		putBE32(&entry, b.size - levStart);
+	}
+	addMbkBlobs(f, mbk, b.size - mbkStart);
+	addLevel(f, "LEVEL1.LEV", lev, mbk, pal, sgd);
+
+	/* SPR and TAB, 0xF? bytes are nibble runs */
+	static const uint8_t kSprHeader[] = { 0x53, 0x50, 0x54, 0x00, 0x05, 0x07, 0x00, 0x02, 0x00, 0x20, 0x00, 0x18 };
+	const uint8_t *spr = b.data + b.size;
+	putBytes(&b, kSprHeader, sizeof(kSprHeader));
+	const int sprStart = b.size;
+	struct buffer_t tab = { buf + kBufferSize - 1287 * 4, 0 };
+	for (int i = 0; i < 1287; ++i) {
+		putBE32(&tab, b.size - sprStart);
+		b.data[b.size++] = rnd(256);
+		b.data[b.size++] = rnd(256);
+		const int lenOffset = b.size;
+		b.size += 2;
+		for (int size = 0; size < 32 * 48 / 2; ) {
+			if (rnd(4) == 0) {
+				int count = 1 + rnd(64);
+				if (count > 32 * 48 / 2 - size) {
+					count = 32 * 48 / 2 - size;
+				}
+				b.data[b.size++] = 0xF0 | rnd(15);
+				b.data[b.size++] = count - 1;
+				size += count;
+			} else {
+				b.data[b.size++] = (rnd(15) << 4) | rnd(15);
+				++size;
+			}
+		}
+		const int len = b.size - lenOffset - 2;
+		b.data[lenOffset] = (len - 1) >> 8;
+		b.data[lenOffset + 1] = (len - 1) & 255;
+	}
+	assert(b.size < kBufferSize - 1287 * 4);
+	f->spr = spr;
+	f->tab = tab.data;
+	return buf;
+}
+
+struct result_t {
+	const char *stage;
+	int items;
+	double bytes;
+	double seconds; /* best of the iterations */
+};
+
+static void printResult(const struct result_t *r) {
+	fprintf(stdout, "%-8s %6d items %10.0f bytes %9.3f ms", r->stage, r->items, r->bytes, r->seconds * 1000);
+	if (r->bytes != 0) {
+		fprintf(stdout, " %9.1f MB/s", r->bytes / r->seconds / 1000000);
+	}
+	fprintf(stdout, " %10.1f items/s\n", r->items / r->seconds);
+}
+
+static void benchUnpack(const struct fixture_t *f, struct result_t *r) {
+	static uint8_t buf[0x10000];
+	r->items = f->blobsCount;
+	r->bytes = 0;
+	for (int i = 0; i < f->blobsCount; ++i) {
+		const struct blob_t *b = &f->blobs[i];
+		const uint32_t ret = bytekiller_unpack(buf, sizeof(buf), b->data, b->size);
+		assert(ret == 0);
+		r->bytes += READ_BE_UINT32(b->data + b->size - 4);
+	}
+}
+
+static void benchRLE(const struct fixture_t *f, struct result_t *r) {
+	static uint8_t buf[7174 * 16];
+	r->items = 0;
+	r->bytes = 0;
+	for (int i = 0; i < f->levelsCount; ++i) {
+		const uint8_t *sgd = f->levels[i].sgd;
+		if (!sgd) {
+			continue;
+		}
+		const int count = (READ_BE_UINT32(sgd) / 4) - 1;
+		for (int num = 0; num < count; ++num) {
+			const int32_t offset = READ_BE_UINT32(sgd + num * 4);
+			if (offset >= 0) {
+				r->bytes += decodeRLE(sgd + offset, buf);
+				++r->items;
+			}
+		}
+	}
+}
+
+static void benchRooms(const struct fixture_t *f, struct result_t *r) {
+	r->items = 0;
+	r->bytes = 0;
+	clearMbkCache();
+	for (int i = 0; i < f->levelsCount; ++i) {
+		const struct level_t *l = &f->levels[i];
+		decodeLEV(l->name, l->lev, l->mbk, l->pal, l->sgd);
+		r->items += l->rooms;
+		r->bytes += l->rooms * 256 * 224;
+	}
+}
+
+static void benchSprites(const struct fixture_t *f, struct result_t *r) {
+	r->items = 0;
+	r->bytes = 0;
+	if (f->spr && f->tab) {
+		decodeSPR("GLOBAL.SPR", f->spr, f->tab);
+		r->items = 1287;
+		r->bytes = 1287 * 32 * 48;
+	}
+}
+
+static bool _benchOutput;
+
+static void benchBMP(const struct fixture_t *f, struct result_t *r) {
+	static const int W = 256;
+	static const int H = 224;
+	static const int kCount = 256;
+	static uint8_t bitmap[256 * 224];
+	static uint8_t palette[256 * 3];
+	static uint8_t *buf;
+	if (!buf) {
+		for (int i = 0; i < W * H; ++i) {
+			bitmap[i] = (i ^ (i >> 8)) & 63;
+		}
+		buf = (uint8_t *)malloc(getBMPSize(W, H));
+	}
+	r->items = kCount;
+	r->bytes = 0;
+	for (int i = 0; i < kCount; ++i) {
+		if (_benchOutput) {
+			char name[32];
+			snprintf(name, sizeof(name), "bench%03d.bmp", i);
+			saveBMP(name, bitmap, W, H, palette, 64);
+			r->bytes += getBMPSize(W, H);
+		} else {
+			r->bytes += encodeBMP(buf, bitmap, W, H, palette, 64);
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(const struct fixture_t *f, struct result_t *r);
+} _stages[] = {
+	{ "unpack", benchUnpack },
+	{ "rle", benchRLE },
+	{ "rooms", benchRooms },
+	{ "sprites", benchSprites },
+	{ "bmp", benchBMP },
+	{ 0, 0 }
+};
+
+static const char *USAGE =
+	"Usage: %s [OPTIONS]... [ROM]\n"
+	"  --iterations=NUM       Number of runs of each stage (default 5)\n"
+	"  --stage=NAME           Only run this stage (unpack, rle, rooms, sprites, bmp)\n"
+	"  --output               Write the decoded images\n"
+	"  --output_dir=PATH      Directory where the images are written\n"
+	"  --roms=PATH            ROM list (default 'roms.xml')\n"
+	"Synthetic data is used if no ROM is given.\n";
+
+int main(int argc, char *argv[]) {
+	int iterations = 5;
+	const char *stage = 0;
+	const char *outputDir = 0;
+	const char *romsPath = "roms.xml";
+	while (1) {
+		static struct option lopts[] = {
+			{ "iterations", required_argument, 0, 'i' },
+			{ "stage",      required_argument, 0, 's' },
+			{ "output",     no_argument,       0, 'w' },
+			{ "output_dir", required_argument, 0, 'o' },
+			{ "roms",       required_argument, 0, 'r' },
+			{ 0, 0, 0, 0 }
+		};
+		int index;
+		const int c = getopt_long(argc, argv, "", lopts, &index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			stage = optarg;
+			break;
+		case 'w':
+			_benchOutput = true;
+			break;
+		case 'o':
+			outputDir = optarg;
+			break;
+		case 'r':
+			romsPath = optarg;
+			break;
+		default:
+			fprintf(stdout, USAGE, argv[0]);
+			return -1;
+		}
+	}
+	static struct fixture_t fixture;
+	static struct rom_t rom;
+	uint8_t *synthetic = 0;
+	if (optind < argc) {
+		if (!openRom(&rom, argv[optind], romsPath, 0)) {
+			return -1;
+		}
+		loadRomFixture(&fixture, &rom);
+	} else {
+		synthetic = createSyntheticFixture(&fixture);
+		if (!synthetic) {
+			return -1;
+		}
+	}
+	if (outputDir && chdir(outputDir) != 0) {
+		fprintf(stderr, "Unable to change directory to '%s'\n", outputDir);
+		return -1;
+	}
+	setImageOutput(_benchOutput);
+	for (int i = 0; _stages[i].name; ++i) {
+		if (stage && strcmp(stage, _stages[i].name) != 0) {
+			continue;
+		}
+		struct result_t result;
+		result.stage = _stages[i].name;
+		result.seconds = 0;
+		for (int j = 0; j < iterations; ++j) {
+			const double t0 = getTime();
+			(_stages[i].run)(&fixture, &result);
+			const double t = getTime() - t0;
+			if (j == 0 || t < result.seconds) {
+				result.seconds = t;
+			}
+		}
+		if (result.items != 0) {
+			printResult(&result);
+		}
+	}
+	free(synthetic);
+	closeRom(&rom);
+	return 0;
+}
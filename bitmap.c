@@ -1,71 +1,373 @@
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bitmap.h"
+#include "metrics.h"
+#include "sha1.h"
+#include "trace.h"
+#include "writer.h"
 
-static void fwriteUint16LE(FILE *fp, uint16_t value) {
-	fputc(value & 255, fp);
-	fputc(value >> 8, fp);
+static const int kHeaderSize = 14 + 40 + 4 * 256;
+
+static uint8_t *writeUint16LE(uint8_t *dst, uint16_t value) {
+	dst[0] = value & 255;
+	dst[1] = value >> 8;
+	return dst + 2;
 }
 
-static void fwriteUint32LE(FILE *fp, uint32_t value) {
-	fwriteUint16LE(fp, value & 0xFFFF);
-	fwriteUint16LE(fp, value >> 16);
+static uint8_t *writeUint32LE(uint8_t *dst, uint32_t value) {
+	dst = writeUint16LE(dst, value & 0xFFFF);
+	return writeUint16LE(dst, value >> 16);
 }
 
 static const uint16_t TAG_BM = 0x4D42;
 
+int getBMPSize(int w, int h) {
+	const int alignWidth = (w + 3) & ~3;
+	return kHeaderSize + alignWidth * h;
+}
+
+int encodeBMP(uint8_t *dst, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors) {
+	const int alignWidth = (w + 3) & ~3;
+	const int imageSize = alignWidth * h;
+	uint8_t *p = dst;
+
+	// Write file header
+	p = writeUint16LE(p, TAG_BM);
+	p = writeUint32LE(p, kHeaderSize + imageSize);
+	p = writeUint16LE(p, 0); // reserved1
+	p = writeUint16LE(p, 0); // reserved2
+	p = writeUint32LE(p, kHeaderSize);
+
+	// Write info header
+	p = writeUint32LE(p, 40);
+	p = writeUint32LE(p, w);
+	p = writeUint32LE(p, h);
+	p = writeUint16LE(p, 1); // planes
+	p = writeUint16LE(p, 8); // bit_count
+	p = writeUint32LE(p, 0); // compression
+	p = writeUint32LE(p, imageSize); // size_image
+	p = writeUint32LE(p, 0); // x_pels_per_meter
+	p = writeUint32LE(p, 0); // y_pels_per_meter
+	p = writeUint32LE(p, 0); // num_colors_used
+	p = writeUint32LE(p, 0); // num_colors_important
+
+	// Write palette data
+	for (int i = 0; i < colors; ++i) {
+		p[0] = pal[2];
+		p[1] = pal[1];
+		p[2] = pal[0];
+		p[3] = 0;
+		p += 4;
+		pal += 3;
+	}
+	// Pad palette to 256 colors
+	memset(p, 0, (256 - colors) * 4);
+	p += (256 - colors) * 4;
+
+	// Write bitmap data
+	const int pitch = w;
+	bits += h * pitch;
+	for (int i = 0; i < h; ++i) {
+		bits -= pitch;
+		memcpy(p, bits, w);
+		memset(p + w, 0, alignWidth - w);
+		p += alignWidth;
+	}
+	assert(p - dst == kHeaderSize + imageSize);
+	return p - dst;
+}
+
+uint8_t *allocBMP(const uint8_t *bits, int w, int h, const uint8_t *pal, int colors, int *size) {
+	uint8_t *buf = (uint8_t *)malloc(getBMPSize(w, h));
+	if (buf) {
+		*size = encodeBMP(buf, bits, w, h, pal, colors);
+	}
+	return buf;
+}
+
+uint8_t *allocBMPRGB(const uint8_t *rgb, int w, int h, int *size) {
+	const int alignPitch = (w * 3 + 3) & ~3;
+	const int headerSize = 14 + 40;
+	const int imageSize = alignPitch * h;
+	uint8_t *buf = (uint8_t *)malloc(headerSize + imageSize);
+	if (buf) {
+		uint8_t *p = buf;
+		p = writeUint16LE(p, TAG_BM);
+		p = writeUint32LE(p, headerSize + imageSize);
+		p = writeUint32LE(p, 0); // reserved
+		p = writeUint32LE(p, headerSize);
+		p = writeUint32LE(p, 40);
+		p = writeUint32LE(p, w);
+		p = writeUint32LE(p, h);
+		p = writeUint16LE(p, 1); // planes
+		p = writeUint16LE(p, 24); // bit_count
+		memset(p, 0, 24); // compression, size_image, pels_per_meter, colors
+		p += 24;
+		for (int y = h - 1; y >= 0; --y) {
+			const uint8_t *src = rgb + y * w * 3;
+			for (int x = 0; x < w; ++x, src += 3) {
+				p[x * 3]     = src[2];
+				p[x * 3 + 1] = src[1];
+				p[x * 3 + 2] = src[0];
+			}
+			memset(p + w * 3, 0, alignPitch - w * 3);
+			p += alignPitch;
+		}
+		*size = p - buf;
+	}
+	return buf;
+}
+
+void freeBMP(uint8_t *buf) {
+	free(buf);
+}
+
 void saveBMP(const char *filename, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors) {
-	FILE *fp = fopen(filename, "wb");
-	if (fp) {
-		const int alignWidth = (w + 3) & ~3;
-		const int imageSize = alignWidth * h;
-
-		// Write file header
-		fwriteUint16LE(fp, TAG_BM);
-		fwriteUint32LE(fp, 14 + 40 + 4 * 256 + imageSize);
-		fwriteUint16LE(fp, 0); // reserved1
-		fwriteUint16LE(fp, 0); // reserved2
-		fwriteUint32LE(fp, 14 + 40 + 4 * 256);
-
-		// Write info header
-		fwriteUint32LE(fp, 40);
-		fwriteUint32LE(fp, w);
-		fwriteUint32LE(fp, h);
-		fwriteUint16LE(fp, 1); // planes
-		fwriteUint16LE(fp, 8); // bit_count
-		fwriteUint32LE(fp, 0); // compression
-		fwriteUint32LE(fp, imageSize); // size_image
-		fwriteUint32LE(fp, 0); // x_pels_per_meter
-		fwriteUint32LE(fp, 0); // y_pels_per_meter
-		fwriteUint32LE(fp, 0); // num_colors_used
-		fwriteUint32LE(fp, 0); // num_colors_important
-
-		// Write palette data
-		for (int i = 0; i < colors; ++i) {
-			fputc(pal[2], fp);
-			fputc(pal[1], fp);
-			fputc(pal[0], fp);
-			fputc(0, fp);
-			pal += 3;
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "image", "saveBMP");
+	int size;
+	uint8_t *buf = allocBMP(bits, w, h, pal, colors, &size);
+	if (buf) {
+		countImageFile(kImageBMP, size);
+		writeOutputBuffer(filename, buf, size);
+		addTraceArg(&scope, "bytes", size);
+	}
+	endTraceScope(&scope);
+}
+
+struct outputfile_t {
+	char name[128];
+	char hash[41];
+};
+
+static int _incrementalOutput;
+static pthread_mutex_t _outputLogMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct outputfile_t *_outputLog;
+static int _outputLogCount, _outputLogSize;
+
+/* files of the previous run, sorted by name on the first lookup */
+static struct outputfile_t *_recordedFiles;
+static int _recordedCount, _recordedSize;
+static bool _recordedSorted;
+
+void setIncrementalOutput(int enabled) {
+	_incrementalOutput = enabled;
+}
+
+static int compareOutputFiles(const void *a, const void *b) {
+	return strcmp(((const struct outputfile_t *)a)->name, ((const struct outputfile_t *)b)->name);
+}
+
+void addRecordedOutputHash(const char *filename, const char *hash) {
+	pthread_mutex_lock(&_outputLogMutex);
+	if (_recordedCount == _recordedSize) {
+		const int count = _recordedSize ? _recordedSize * 2 : 256;
+		struct outputfile_t *files = (struct outputfile_t *)realloc(_recordedFiles, count * sizeof(struct outputfile_t));
+		if (files) {
+			_recordedFiles = files;
+			_recordedSize = count;
 		}
-		// Pad palette to 256 colors
-		for (int i = colors; i < 256; ++i) {
-			fwriteUint32LE(fp, 0);
+	}
+	if (_recordedCount < _recordedSize) {
+		struct outputfile_t *f = &_recordedFiles[_recordedCount++];
+		snprintf(f->name, sizeof(f->name), "%s", filename);
+		snprintf(f->hash, sizeof(f->hash), "%s", hash);
+		_recordedSorted = false;
+	}
+	pthread_mutex_unlock(&_outputLogMutex);
+}
+
+void clearRecordedOutputHashes(void) {
+	pthread_mutex_lock(&_outputLogMutex);
+	free(_recordedFiles);
+	_recordedFiles = 0;
+	_recordedCount = _recordedSize = 0;
+	pthread_mutex_unlock(&_outputLogMutex);
+}
+
+/* logs the file, returns true if the previous run recorded it with the same content */
+static bool logOutputFile(const char *filename, const uint8_t *data, int size) {
+	uint8_t digest[20];
+	sha1(data, size, digest);
+	struct outputfile_t file;
+	snprintf(file.name, sizeof(file.name), "%s", filename);
+	for (int i = 0; i < 20; ++i) {
+		snprintf(file.hash + i * 2, 3, "%02x", digest[i]);
+	}
+	pthread_mutex_lock(&_outputLogMutex);
+	if (_outputLogCount == _outputLogSize) {
+		const int count = _outputLogSize ? _outputLogSize * 2 : 256;
+		struct outputfile_t *log = (struct outputfile_t *)realloc(_outputLog, count * sizeof(struct outputfile_t));
+		if (log) {
+			_outputLog = log;
+			_outputLogSize = count;
 		}
+	}
+	if (_outputLogCount < _outputLogSize) {
+		_outputLog[_outputLogCount++] = file;
+	}
+	if (!_recordedSorted && _recordedCount != 0) {
+		qsort(_recordedFiles, _recordedCount, sizeof(struct outputfile_t), compareOutputFiles);
+		_recordedSorted = true;
+	}
+	const struct outputfile_t *recorded = (_recordedCount == 0) ? 0 : (const struct outputfile_t *)bsearch(&file, _recordedFiles, _recordedCount, sizeof(struct outputfile_t), compareOutputFiles);
+	const bool same = recorded && strcmp(recorded->hash, file.hash) == 0;
+	pthread_mutex_unlock(&_outputLogMutex);
+	return same;
+}
 
-		// Write bitmap data
-		const int pitch = w;
-		bits += h * pitch;
-		for (int i = 0; i < h; ++i) {
-			bits -= pitch;
-			fwrite(bits, w, 1, fp);
-			int pad = alignWidth - w;
-			while (pad--) {
-				fputc(0, fp);
-			}
+/* the files recorded with the same content are not read back, the writers only check they are still there */
+void writeOutputBuffer(const char *filename, uint8_t *data, int size) {
+	countOutputFile(size);
+	bool same = false;
+	if (_incrementalOutput) {
+		same = logOutputFile(filename, data, size);
+	}
+	writeFileBuffer(filename, data, size, same);
+}
+
+void writeOutputFile(const char *filename, const uint8_t *data, int size) {
+	uint8_t *buf = (uint8_t *)malloc(size);
+	if (buf) {
+		memcpy(buf, data, size);
+		writeOutputBuffer(filename, buf, size);
+	}
+}
+
+int getOutputLogCount(void) {
+	return _outputLogCount;
+}
+
+const char *getOutputLogName(int num) {
+	return (num < _outputLogCount) ? _outputLog[num].name : 0;
+}
+
+const char *getOutputLogHash(int num) {
+	return (num < _outputLogCount) ? _outputLog[num].hash : 0;
+}
+
+void clearOutputLog(void) {
+	pthread_mutex_lock(&_outputLogMutex);
+	free(_outputLog);
+	_outputLog = 0;
+	_outputLogCount = _outputLogSize = 0;
+	pthread_mutex_unlock(&_outputLogMutex);
+}
+
+static int _imageFormat = kImageBMP;
+static int _pngLevel = 6;
+static int _imageOutput = 1;
+
+void setImageFormat(int format, int level) {
+	_imageFormat = format;
+	_pngLevel = level;
+}
+
+const char *getImageExtension(void) {
+	return (_imageFormat == kImagePNG) ? "png" : "bmp";
+}
+
+void setImageOutput(int enabled) {
+	_imageOutput = enabled;
+}
+
+struct imagenode_t {
+	struct image_t image; /* first, freeImage casts it back */
+	struct imagenode_t *next;
+};
+
+static int _imageCapture;
+static pthread_mutex_t _imageQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct imagenode_t *_imageQueueHead, *_imageQueueTail;
+
+void setImageCapture(int enabled) {
+	_imageCapture = enabled;
+}
+
+/* the pixels are stored after the node, in the same allocation */
+static void captureImage(const char *name, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors) {
+	struct imagenode_t *node = (struct imagenode_t *)malloc(sizeof(struct imagenode_t) + w * h);
+	if (!node) {
+		return;
+	}
+	struct image_t *image = &node->image;
+	snprintf(image->name, sizeof(image->name), "%s", name);
+	image->w = w;
+	image->h = h;
+	image->colors = colors;
+	memset(image->palette, 0, sizeof(image->palette));
+	memcpy(image->palette, pal, colors * 3);
+	image->bits = (uint8_t *)(node + 1);
+	memcpy(image->bits, bits, w * h);
+	node->next = 0;
+	pthread_mutex_lock(&_imageQueueMutex);
+	if (_imageQueueTail) {
+		_imageQueueTail->next = node;
+	} else {
+		_imageQueueHead = node;
+	}
+	_imageQueueTail = node;
+	pthread_mutex_unlock(&_imageQueueMutex);
+}
+
+struct image_t *popImage(void) {
+	pthread_mutex_lock(&_imageQueueMutex);
+	struct imagenode_t *node = _imageQueueHead;
+	if (node) {
+		_imageQueueHead = node->next;
+		if (!_imageQueueHead) {
+			_imageQueueTail = 0;
 		}
+	}
+	pthread_mutex_unlock(&_imageQueueMutex);
+	return node ? &node->image : 0;
+}
+
+void freeImage(struct image_t *image) {
+	free(image);
+}
+
+void saveImage(const char *name, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors) {
+	if (_imageCapture) {
+		captureImage(name, bits, w, h, pal, colors);
+	}
+	if (!_imageOutput) {
+		return;
+	}
+	char filename[256];
+	if (_imageFormat == kImagePNG) {
+		snprintf(filename, sizeof(filename), "%s.png", name);
+		savePNG(filename, bits, w, h, pal, colors, _pngLevel);
+	} else {
+		snprintf(filename, sizeof(filename), "%s.bmp", name);
+		saveBMP(filename, bits, w, h, pal, colors);
+	}
+}
 
-		fclose(fp);
+void saveImageRGB(const char *name, const uint8_t *rgb, int w, int h) {
+	if (!_imageOutput) {
+		return;
+	}
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "image", (_imageFormat == kImagePNG) ? "savePNG" : "saveBMP");
+	char filename[256];
+	int size;
+	uint8_t *buf;
+	if (_imageFormat == kImagePNG) {
+		snprintf(filename, sizeof(filename), "%s.png", name);
+		buf = allocPNGRGB(rgb, w, h, _pngLevel, &size);
+	} else {
+		snprintf(filename, sizeof(filename), "%s.bmp", name);
+		buf = allocBMPRGB(rgb, w, h, &size);
+	}
+	if (buf) {
+		countImageFile(_imageFormat, size);
+		writeOutputBuffer(filename, buf, size);
+		addTraceArg(&scope, "bytes", size);
 	}
+	endTraceScope(&scope);
 }
@@ -4,6 +4,62 @@
 
 #include <stdint.h>
 
+/* encoded size of a 8 bits per pixel bitmap */
+int getBMPSize(int w, int h);
+/* encodes to 'dst', which must hold getBMPSize bytes, returns the number of bytes written */
+int encodeBMP(uint8_t *dst, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors);
+/* returns a buffer owned by the caller, to be released with freeBMP */
+uint8_t *allocBMP(const uint8_t *bits, int w, int h, const uint8_t *pal, int colors, int *size);
+void freeBMP(uint8_t *buf);
+
 void saveBMP(const char *filename, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors);
 
+/* indexed PNG, 4 bits per pixel if no index is above 15, the palette covers the highest index used, 'level' is the zlib compression level */
+uint8_t *allocPNG(const uint8_t *bits, int w, int h, const uint8_t *pal, int colors, int level, int *size);
+/* 24 bits per pixel, 'rgb' holds 3 bytes per pixel */
+uint8_t *allocBMPRGB(const uint8_t *rgb, int w, int h, int *size);
+uint8_t *allocPNGRGB(const uint8_t *rgb, int w, int h, int level, int *size);
+void savePNG(const char *filename, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors, int level);
+
+enum {
+	kImageBMP,
+	kImagePNG
+};
+
+void setImageFormat(int format, int level);
+const char *getImageExtension(void);
+/* when disabled, saveImage does not encode nor write anything */
+void setImageOutput(int enabled);
+/* when enabled, each file is logged with the SHA-1 of its content, and the files recorded with the same SHA-1 are not rewritten */
+void setIncrementalOutput(int enabled);
+/* SHA-1 of a file written by the previous run, as read from the manifest */
+void addRecordedOutputHash(const char *filename, const char *hash);
+void clearRecordedOutputHashes(void);
+void writeOutputFile(const char *filename, const uint8_t *data, int size);
+/* same as writeOutputFile, takes ownership of 'data' allocated with malloc */
+void writeOutputBuffer(const char *filename, uint8_t *data, int size);
+int getOutputLogCount(void);
+const char *getOutputLogName(int num);
+const char *getOutputLogHash(int num);
+void clearOutputLog(void);
+
+struct image_t {
+	char name[64];
+	int w, h;
+	int colors;
+	uint8_t palette[256 * 3];
+	uint8_t *bits; /* w * h bytes, one palette index per pixel */
+};
+
+/* when enabled, saveImage also queues a copy of each image, for callers not reading the files back */
+void setImageCapture(int enabled);
+/* returns the oldest queued image or 0, it is owned by the caller and released with freeImage */
+struct image_t *popImage(void);
+void freeImage(struct image_t *image);
+
+/* 'name' has no extension, it is appended according to the selected format */
+void saveImage(const char *name, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors);
+/* same as saveImage for 24 bits images, they are not captured */
+void saveImageRGB(const char *name, const uint8_t *rgb, int w, int h);
+
 #endif /* BITMAP_H__ */
@@ -1,6 +1,9 @@
 
 #include <math.h>
 #include "bitmap.h"
+#include "decode.h"
+#include "metrics.h"
+#include "tile.h"
 #include "unpack.h"
 
 static const bool kCheckSinCosTable = false;
@@ -12,72 +15,54 @@ static const uint8_t kPaletteIcons[16 * 3] = {
 	0x00, 0x66, 0x00, 0xee, 0xee, 0x00, 0xaa, 0x22, 0xee, 0x00, 0x00, 0x00
 };
 
-static void decodeCT(const uint8_t *src, uint32_t size) {
+static void decodeCT(struct arena_t *arena, const uint8_t *src, uint32_t size) {
 	const uint32_t uncompressedSize = READ_BE_UINT32(src + size - 4);
 	assert(uncompressedSize == 0x1D00);
-	uint8_t *buf = (uint8_t *)malloc(uncompressedSize);
+	uint8_t *buf = (uint8_t *)allocArena(arena, uncompressedSize);
 	if (buf) {
 		const uint32_t ret = bytekiller_unpack(buf, uncompressedSize, src, size);
 		assert(ret == 0);
-		free(buf);
 	}
 }
 
-static void decodeFNT(const uint8_t *src, uint32_t size) {
+static void decodeFNT(struct arena_t *arena, const uint8_t *src, uint32_t size) {
 	static const int W = 8;
 	static const int H = 8;
 	const int count = size / 32;
-	uint8_t *bitmap = (uint8_t *)malloc(W * H * count);
+	uint8_t *bitmap = (uint8_t *)allocArena(arena, W * H * count);
 	if (bitmap) {
 		for (int i = 0; i < count; ++i) {
-			for (int y = 0; y < H; ++y) {
-				uint8_t *dst = bitmap + y * W * count + i * W;
-				for (int x = 0; x < 4; ++x) {
-					const uint8_t color = *src++;
-					*dst++ = color >> 4;
-					*dst++ = color & 15;
-				}
-			}
+			expandTile8x8(bitmap + i * W, W * count, src, 0);
+			src += 32;
 		}
 		uint8_t palette[16 * 3];
 		for (int i = 0; i < 16; ++i) {
 			palette[i * 3] = palette[i * 3 + 1] = palette[i * 3 + 2] = (i << 4) | i;
 		}
-		saveBMP("font.bmp", bitmap, W * count, H, palette, 16);
-		free(bitmap);
+		saveImage("font", bitmap, W * count, H, palette, 16);
 	}
 }
 
-static void decodeICN(const uint8_t *src, uint32_t size) {
+static void decodeICN(struct arena_t *arena, const uint8_t *src, uint32_t size) {
 	static const int W = 16;
 	static const int H = 16;
 	const int count = size / 128;
-	uint8_t *bitmap = (uint8_t *)malloc(W * H * count);
+	uint8_t *bitmap = (uint8_t *)allocArena(arena, W * H * count);
 	if (bitmap) {
-		int offset = 0;
 		for (int i = 0; i < count; ++i) {
-			for (int y = 0; y < H; ++y) {
-				uint8_t *dst = bitmap + y * W * count + i * W;
-				for (int x = 0; x < 4; ++x) {
-					const uint8_t color = src[offset + x];
-					*dst++ = color >> 4;
-					*dst++ = color & 15;
-				}
-				for (int x = 0; x < 4; ++x) {
-					const uint8_t color = src[offset + 64 + x];
-					*dst++ = color >> 4;
-					*dst++ = color & 15;
-				}
-				offset += 4;
-			}
-			offset += 64;
+			/* left and right columns of two 8x8 tiles */
+			uint8_t *dst = bitmap + i * W;
+			expandTile8x8(dst, W * count, src, 0);
+			expandTile8x8(dst + 8 * W * count, W * count, src + 32, 0);
+			expandTile8x8(dst + 8, W * count, src + 64, 0);
+			expandTile8x8(dst + 8 * W * count + 8, W * count, src + 96, 0);
+			src += 128;
 		}
-		saveBMP("icons.bmp", bitmap, W * count, H, kPaletteIcons, 16);
-		free(bitmap);
+		saveImage("icons", bitmap, W * count, H, kPaletteIcons, 16);
 	}
 }
 
-static void decodeOBJ(const uint8_t *src, uint32_t size) {
+static void decodeOBJ(struct arena_t *arena, const uint8_t *src, uint32_t size) {
 	uint32_t offset = READ_BE_UINT32(src); /* offset to first object_t */
 	while (offset < size) {
 		const int count = READ_BE_UINT16(src + offset); offset += 2;
@@ -86,30 +71,61 @@ static void decodeOBJ(const uint8_t *src, uint32_t size) {
 	assert(offset == size);
 }
 
-static void decodePGE(const uint8_t *src, uint32_t size) {
+static void decodePGE(struct arena_t *arena, const uint8_t *src, uint32_t size) {
 	const int count = READ_BE_UINT16(src); src += 2;
 	assert((size - 2) == count * sizeof(struct piege_t));
 }
 
 struct {
 	const char *ext;
-	void (*decode)(const uint8_t *data, uint32_t size);
+	void (*decode)(struct arena_t *arena, const uint8_t *data, uint32_t size);
+	int metrics;
 } _decoders[] = {
-	{ "CT",  decodeCT },
-	{ "FNT", decodeFNT },
-	{ "ICN", decodeICN },
-	{ "OBJ", decodeOBJ },
-	{ "PGE", decodePGE },
-	{ 0, 0 }
+	{ "CT",  decodeCT,  kMetricsCT },
+	{ "FNT", decodeFNT, kMetricsFNT },
+	{ "ICN", decodeICN, kMetricsICN },
+	{ "OBJ", decodeOBJ, kMetricsOBJ },
+	{ "PGE", decodePGE, kMetricsPGE },
+	{ 0, 0, 0 }
 };
 
-void decode(const char *name, const uint8_t *data, uint32_t size) {
+int getDecoderVersion(void) {
+	return DECODER_VERSION;
+}
+
+struct decoder_t *allocDecoder(void) {
+	struct decoder_t *decoder = (struct decoder_t *)malloc(sizeof(struct decoder_t));
+	if (decoder) {
+		initArena(&decoder->arena);
+	}
+	return decoder;
+}
+
+void freeDecoder(struct decoder_t *decoder) {
+	if (decoder) {
+		freeArena(&decoder->arena);
+		free(decoder);
+	}
+}
+
+uint32_t getDecoderPeakSize(const struct decoder_t *decoder) {
+	return decoder->arena.peak;
+}
+
+void decodeCtx(struct decoder_t *decoder, const char *name, const uint8_t *data, uint32_t size) {
 	const char *ext = strrchr(name, '.');
 	if (ext) {
 		++ext;
 		for (int i = 0; _decoders[i].ext; ++i) {
 			if (strcasecmp(ext, _decoders[i].ext) == 0) {
-				(_decoders[i].decode)(data, size);
+				countDecoderCall(_decoders[i].metrics);
+				struct metricsscope_t scope;
+				beginMetricsScope(&scope, _decoders[i].metrics);
+				struct arenamark_t mark;
+				markArena(&decoder->arena, &mark);
+				(_decoders[i].decode)(&decoder->arena, data, size);
+				releaseArena(&decoder->arena, &mark);
+				endMetricsScope(&scope);
 				return;
 			}
 		}
@@ -130,3 +146,11 @@ void decode(const char *name, const uint8_t *data, uint32_t size) {
 		}
 	}
 }
+
+void decode(const char *name, const uint8_t *data, uint32_t size) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeCtx(decoder, name, data, size);
+		freeDecoder(decoder);
+	}
+}
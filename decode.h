@@ -0,0 +1,66 @@
+
+#ifndef DECODE_H__
+#define DECODE_H__
+
+#include "arena.h"
+
+/* bumped whenever the decoders output changes, previous incremental extractions are then discarded */
+#define DECODER_VERSION 4
+
+int getDecoderVersion(void);
+
+/* the working buffers of the decoders are allocated from the context arena, sized for the asset being decoded */
+/* the entry points taking a context can be called concurrently as long as each thread uses its own context */
+struct decoder_t {
+	struct arena_t arena;
+};
+
+struct decoder_t *allocDecoder(void);
+void freeDecoder(struct decoder_t *decoder);
+/* largest amount of memory allocated from the arena */
+uint32_t getDecoderPeakSize(const struct decoder_t *decoder);
+
+void decodeCtx(struct decoder_t *decoder, const char *name, const uint8_t *data, uint32_t size);
+void decodeLEVCtx(struct decoder_t *decoder, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, int threads);
+/* renders a single room, 'bitmap' holds 256x224 pixels and 'palette' 64 RGB colors, returns false if the room is not present */
+bool renderLEVRoom(struct decoder_t *decoder, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, int room, uint8_t *bitmap, uint8_t *palette);
+/* same as decodeLEVCtx, and lays out the rooms following the links of the packed 'ct' data, the tiles of the first level are the rooms and each next level halves the previous one */
+void decodeLEVMapCtx(struct decoder_t *decoder, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize, int threads);
+void decodeSPCCtx(struct decoder_t *decoder, const char *name, const uint8_t *spc, const uint8_t *mbk);
+void decodeRPCtx(struct decoder_t *decoder, const char *name, const uint8_t *rp, const uint8_t *spc, const uint8_t *mbk);
+void decodeSPRCtx(struct decoder_t *decoder, const char *name, const uint8_t *spr, const uint8_t *tab);
+void decodeSPRAtlasCtx(struct decoder_t *decoder, const char *name, const uint8_t *spr, const uint8_t *tab);
+
+/* same as above, with a context allocated for the call */
+void decode(const char *name, const uint8_t *data, uint32_t size);
+void decodeLEV(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd);
+void decodeLEVThreads(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, int threads);
+void decodeLEVMap(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize, int threads);
+/* largest amount of memory used by the decoded SGD shapes of a level */
+uint32_t getSgdCachePeakSize(void);
+void decodeSPC(const char *name, const uint8_t *spc, const uint8_t *mbk);
+void decodeRP(const char *name, const uint8_t *rp, const uint8_t *spc, const uint8_t *mbk);
+void decodeSPR(const char *name, const uint8_t *spr, const uint8_t *tab);
+void decodeSPRAtlas(const char *name, const uint8_t *spr, const uint8_t *tab);
+
+struct decodeasset_t {
+	const char *name;
+	const uint8_t *data;
+	uint32_t size;
+};
+
+enum {
+	kDecodeSprAtlas = 1 << 0,
+	kDecodeLevelMap = 1 << 1
+};
+
+struct decodestats_t {
+	uint32_t tasks;
+	uint32_t steals; /* tasks run by another worker than the one spawning them */
+	uint32_t arenaPeak; /* largest worker context */
+};
+
+/* decodes all the assets of a ROM, the LEV rooms, the sprites and the SPC banks are split in tasks run on 'threads' threads (0 for one per core) */
+void decodeROM(const struct decodeasset_t *assets, int count, int flags, int threads, struct decodestats_t *stats);
+
+#endif /* DECODE_H__ */
@@ -1,5 +1,13 @@
 
+#include <pthread.h>
+#include <unistd.h>
 #include "bitmap.h"
+#include "decode.h"
+#include "mbk.h"
+#include "metrics.h"
+#include "task.h"
+#include "tile.h"
+#include "trace.h"
 #include "unpack.h"
 
 static const int kRoomW = 256;
@@ -27,21 +35,30 @@ static const uint16_t kFlagFlipX = (1 << 11);
 /* bit 10: */
 /* bits 9..0: tile index, -0x380 if .SGD */
 
-#define DECODE_BUFSIZE 0xFFFF
+#define MAX_LEV_THREADS 64
+#define MAX_ROOM_BANKS 16 /* whole MBK banks kept locked while a room is loaded */
 
+static const uint32_t kSgdCacheSize = 4 << 20;
+
+/* the room buffers are allocated from the arena, sized for the room */
 struct decodelev_t {
+	struct arena_t *arena;
 	int level, room;
 	bool sgd;
 	uint8_t roomPalette[16 * 3 * 4];
-	uint8_t decodeLevBuf[4096];
-	uint8_t xTile[32], yTile[32];
-	uint8_t roomBitmap[256 * 224];
+	uint8_t *roomBitmap; /* kRoomW x kRoomH */
 	uint16_t roomOffset10, roomOffset12;
-	uint8_t sgdDecodeBuf[7174 * 16];
-	uint8_t tmp[DECODE_BUFSIZE];
-	uint8_t uncompressedMbkBuffer[DECODE_BUFSIZE]; /* 8x8 tiles, 32 bytes */
+	const struct sgdcache_t *sgdCache;
+	uint8_t *uncompressedMbkBuffer; /* 8x8 tiles, 32 bytes */
+	int tilesCount;
+	uint8_t *tilesState; /* bit set for each orientation expanded */
+	uint8_t (*tiles)[4][64]; /* 8x8 tiles, 8 bits per pixel, indexed by flipY << 1 | flipX */
+	uint8_t (*tilesMask)[4][64]; /* 0xFF for opaque pixels */
 };
 
+/* tiles past the ones loaded for the room */
+static const uint8_t kEmptyTile[32];
+
 static void fillRect(uint8_t *dst, int x, int y, int w, int h, uint8_t color) {
         dst += y * kRoomW + x;
         for (int i = 0; i < h; ++i) {
@@ -50,113 +67,66 @@ static void fillRect(uint8_t *dst, int x, int y, int w, int h, uint8_t color) {
         }
 }
 
+/* the shape is clipped against the room, a pair of pixels is only drawn if both are inside */
 static void decodeTileSGD(uint8_t *dst, int dstPitch, int x, int y, int w, int h, const uint8_t *src, const uint8_t *mask, int size) {
-	const int x0 = x;
-	const int y0 = y;
-
 	++w;
 	++h;
 	const int planarSize = w * 2 * h;
 	assert(planarSize == size);
-
-	dst += y * dstPitch + x;
-
-	for (y = 0; y < h; ++y) {
-		for (x = 0; x < w; ++x) {
-			const uint16_t bits = READ_BE_UINT16(src); src += 2;
-			uint16_t bitmask = 0x8000;
-			for (int b = 0; b < 16; b += 2) {
-				const int offset = x * 16 + b;
-				const uint8_t color = *mask++;
-				if (y0 + y < 0 || y0 + y >= kRoomH) {
-					bitmask >>= 2;
-					continue;
-				}
-				if (x0 + offset < 0 || x0 + offset + 1 >= kRoomW) {
-					bitmask >>= 2;
-					continue;
-				}
-				if (bits & bitmask) {
-					dst[offset] = color >> 4;
-				}
-				bitmask >>= 1;
-				if (bits & bitmask) {
-					dst[offset + 1] = color & 15;
-				}
-				bitmask >>= 1;
-			}
-		}
-		dst += dstPitch;
-	}
+	drawMaskShape16(dst, dstPitch, kRoomW, kRoomH, x, y, w, h, src, mask);
 }
 
-static void decodeTile8x8(uint8_t *dst, int x, int y, uint8_t *src, int mask) {
-	dst += (y * kRoomW + x) * 8;
-	for (y = 0; y < 8; ++y, dst += kRoomW) {
-		for (int i = 0; i < 4; ++i) {
-			dst[2 * i]     = (src[i] >> 4) + mask;
-			dst[2 * i + 1] = (src[i] & 15) + mask;
+/* expands the tile to 8 bits per pixel with the orientation applied, the first time it is used in a room */
+static int getExpandedTile(struct decodelev_t *d, int num, uint16_t flags) {
+	const int orientation = ((flags & kFlagFlipY) ? 2 : 0) | ((flags & kFlagFlipX) ? 1 : 0);
+	if ((d->tilesState[num] & 1) == 0) {
+		expandTile8x8(d->tiles[num][0], 8, d->uncompressedMbkBuffer + num * 32, 0);
+		for (int i = 0; i < 64; ++i) {
+			d->tilesMask[num][0][i] = (d->tiles[num][0][i] != 0) ? 0xFF : 0;
 		}
-		src += 4;
+		d->tilesState[num] |= 1;
 	}
-}
-
-static void decodeMaskTile8x8(uint8_t *dst, int x, int y, uint8_t *src, uint8_t *src_mask, int mask) {
-	dst += (y * kRoomW + x) * 8;
-	for (y = 0; y < 8; ++y, dst += kRoomW) {
-		for (int i = 0; i < 4; ++i) {
-			if ((src[i] >> 4) != 0) {
-				dst[2 * i] = (src[i] >> 4) + mask;
-			}
-			if ((src[i] & 15) != 0) {
-				dst[2 * i + 1] = (src[i] & 15) + mask;
+	if ((d->tilesState[num] & (1 << orientation)) == 0) {
+		const uint8_t *src = d->tiles[num][0];
+		const uint8_t *srcMask = d->tilesMask[num][0];
+		uint8_t *dst = d->tiles[num][orientation];
+		uint8_t *mask = d->tilesMask[num][orientation];
+		for (int y = 0; y < 8; ++y) {
+			const int sy = (orientation & 2) ? 7 - y : y;
+			for (int x = 0; x < 8; ++x) {
+				const int sx = (orientation & 1) ? 7 - x : x;
+				dst[y * 8 + x] = src[sy * 8 + sx];
+				mask[y * 8 + x] = srcMask[sy * 8 + sx];
 			}
 		}
-		src += 4;
+		d->tilesState[num] |= 1 << orientation;
 	}
+	return orientation;
 }
 
-static int decodeRLE(const uint8_t *src, uint8_t *dst) {
-	int uncompressedSize = 0;
-	const uint16_t compressedSize = READ_BE_UINT16(src) & 0x7FFF; src += 2;
-	const uint8_t *src_end = src + compressedSize;
-	do {
-		int8_t code = *src++;
-		if (code < 0) {
-			code = -code;
-			for (int i = 0; i < code + 1; ++i) {
-				*dst++ = *src;
-			}
-			++src;
-		} else {
-			for (int i = 0; i < code + 1; ++i) {
-				*dst++ = *src++;
-			}
-		}
-		uncompressedSize += code + 1;
-	} while (src < src_end);
-	assert(src == src_end);
-	return uncompressedSize;
-}
-
-static uint8_t *flipTileY(uint8_t *a2, uint8_t *yTile) {
-	for (int y = 0; y < 8; ++y) {
-		memcpy(yTile + (7 - y) * 4, a2, 4);
-		a2 += 4;
+/* the palette offset is at most 0x30, adding it to each byte of the row cannot carry */
+static void drawTile8x8(uint8_t *dst, int x, int y, const uint8_t *tile, int mask) {
+	const uint64_t offset = mask * 0x0101010101010101ULL;
+	dst += (y * kRoomW + x) * 8;
+	for (y = 0; y < 8; ++y, dst += kRoomW, tile += 8) {
+		uint64_t pixels;
+		memcpy(&pixels, tile, 8);
+		pixels += offset;
+		memcpy(dst, &pixels, 8);
 	}
-	return yTile;
 }
 
-static uint8_t *flipTileX(uint8_t *a2, uint8_t *xTile) {
-	uint8_t *a0 = &xTile[0];
-	for (int y = 0; y < 8; ++y) {
-		for (int x = 0; x < 4; ++x) {
-			const uint8_t b = a2[3 - x];
-			*a0++ = (b >> 4) | ((b & 15) << 4);
-		}
-		a2 += 4;
+static void drawMaskTile8x8(uint8_t *dst, int x, int y, const uint8_t *tile, const uint8_t *tileMask, int mask) {
+	const uint64_t offset = mask * 0x0101010101010101ULL;
+	dst += (y * kRoomW + x) * 8;
+	for (y = 0; y < 8; ++y, dst += kRoomW, tile += 8, tileMask += 8) {
+		uint64_t pixels, opaque, current;
+		memcpy(&pixels, tile, 8);
+		memcpy(&opaque, tileMask, 8);
+		memcpy(&current, dst, 8);
+		current = (current & ~opaque) | ((pixels + offset) & opaque);
+		memcpy(dst, &current, 8);
 	}
-	return xTile;
 }
 
 static void decodeLevRoomHelper(struct decodelev_t *d, const uint8_t *lev) {
@@ -167,15 +137,13 @@ static void decodeLevRoomHelper(struct decodelev_t *d, const uint8_t *lev) {
 				const uint16_t flags = READ_BE_UINT16(a0); a0 += 2;
 				uint16_t tileNum = flags & 0x7FF;
 				if (tileNum != 0) {
-					uint8_t *a2 = d->uncompressedMbkBuffer + tileNum * 32;
-					if (flags & kFlagFlipY) {
-						a2 = flipTileY(a2, d->yTile);
-					}
-					if (flags & kFlagFlipX) {
-						a2 = flipTileX(a2, d->xTile);
-					}
 					const int mask = (flags >> 9) & 0x30;
-					decodeTile8x8(d->roomBitmap, x, y, a2, mask);
+					if (tileNum < d->tilesCount) {
+						const int orientation = getExpandedTile(d, tileNum, flags);
+						drawTile8x8(d->roomBitmap, x, y, d->tiles[tileNum][orientation], mask);
+					} else {
+						expandTile8x8(d->roomBitmap + (y * kRoomW + x) * 8, kRoomW, kEmptyTile, mask);
+					}
 				}
 			}
 		}
@@ -188,27 +156,110 @@ static void decodeLevRoomHelper(struct decodelev_t *d, const uint8_t *lev) {
 			if (tileNum != 0 && d->sgd) {
 				tileNum -= 0x380;
 			}
-			if (tileNum != 0) {
-				uint8_t *a2 = d->uncompressedMbkBuffer + tileNum * 32;
-				if (flags & kFlagFlipY) {
-					a2 = flipTileY(a2, d->yTile);
-				}
-				if (flags & kFlagFlipX) {
-					a2 = flipTileX(a2, d->xTile);
-				}
+			/* the empty tile is fully transparent */
+			if (tileNum != 0 && tileNum < d->tilesCount) {
 				const int mask = (flags >> 9) & 0x30;
-				decodeMaskTile8x8(d->roomBitmap, x, y, a2, 0, mask);
+				const int orientation = getExpandedTile(d, tileNum, flags);
+				drawMaskTile8x8(d->roomBitmap, x, y, d->tiles[tileNum][orientation], d->tilesMask[tileNum][orientation], mask);
 			}
 		}
 	}
 }
 
+/* decoded SGD shapes of a level, shared by the rooms */
+struct sgdshape_t {
+	const uint8_t *data; /* header, planar bits and mask, 0 if not cached */
+	int len;
+};
+
+struct sgdcache_t {
+	int count;
+	struct sgdshape_t *shapes;
+	uint8_t *buffer;
+	uint32_t size;
+};
+
+static uint32_t _sgdCachePeakSize;
+
+/* decodes all the shapes of the level once, shapes not fitting in kSgdCacheSize are decoded when drawn */
+static void initSgdCache(struct sgdcache_t *cache, struct arena_t *arena, const uint8_t *sgd) {
+	memset(cache, 0, sizeof(struct sgdcache_t));
+	const int count = (READ_BE_UINT32(sgd) / 4) - 1; /* last offset is end of file */
+	uint32_t size = 0;
+	for (int num = 0; num < count; ++num) {
+		const int offset = READ_BE_UINT32(sgd + num * 4);
+		if (offset >= 0) {
+			const int len = getRLESize(sgd + offset);
+			if (size + len <= kSgdCacheSize) {
+				size += len;
+			}
+		}
+	}
+	cache->shapes = (struct sgdshape_t *)callocArena(arena, count * sizeof(struct sgdshape_t));
+	cache->buffer = (uint8_t *)allocArena(arena, size);
+	if (!cache->shapes || !cache->buffer) {
+		return;
+	}
+	cache->count = count;
+	for (int num = 0; num < count; ++num) {
+		struct sgdshape_t *shape = &cache->shapes[num];
+		int offset = READ_BE_UINT32(sgd + num * 4);
+		if (offset < 0) { /* not compressed, use the data in place */
+			offset = -offset;
+			shape->len = READ_BE_UINT16(sgd + offset);
+			shape->data = sgd + offset + 2;
+		} else if (cache->size + getRLESize(sgd + offset) <= size) {
+			struct tracescope_t scope;
+			beginTraceScope(&scope, "sgd", "sgd_shape");
+			shape->data = cache->buffer + cache->size;
+			shape->len = decodeRLE(sgd + offset, cache->buffer + cache->size);
+			cache->size += shape->len;
+			addTraceArg(&scope, "shape", num);
+			addTraceArg(&scope, "size", shape->len);
+			endTraceScope(&scope);
+		}
+	}
+	const uint32_t total = cache->size + count * sizeof(struct sgdshape_t);
+	uint32_t peak = __atomic_load_n(&_sgdCachePeakSize, __ATOMIC_RELAXED);
+	while (peak < total && !__atomic_compare_exchange_n(&_sgdCachePeakSize, &peak, total, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+uint32_t getSgdCachePeakSize(void) {
+	return __atomic_load_n(&_sgdCachePeakSize, __ATOMIC_RELAXED);
+}
+
+static const uint8_t *loadShape(struct decodelev_t *d, const uint8_t *sgd, int num, int *len) {
+	if (d->sgdCache && num < d->sgdCache->count && d->sgdCache->shapes[num].data) {
+		*len = d->sgdCache->shapes[num].len;
+		return d->sgdCache->shapes[num].data;
+	}
+	int offset = READ_BE_UINT32(sgd + num * 4);
+	if (offset < 0) {
+		offset = -offset;
+		*len = READ_BE_UINT16(sgd + offset);
+		return sgd + offset + 2;
+	}
+	/* released by the caller */
+	uint8_t *buf = (uint8_t *)allocArena(d->arena, getRLESize(sgd + offset));
+	if (!buf) {
+		*len = 0;
+		return 0;
+	}
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "sgd", "sgd_shape");
+	*len = decodeRLE(sgd + offset, buf);
+	addTraceArg(&scope, "shape", num);
+	addTraceArg(&scope, "size", *len);
+	endTraceScope(&scope);
+	return buf;
+}
+
 static void loadSGD(struct decodelev_t *d, const uint8_t *a1, const uint8_t *sgd) {
-	int d2, len;
+	int d2, d3, len;
 
 	const int sgdCount = (READ_BE_UINT32(sgd) / 4) - 1;
 
-	int tileNum = -1;
 	int count = READ_BE_UINT16(a1); a1 += 2;
 	--count;
 	do {
@@ -218,28 +269,16 @@ static void loadSGD(struct decodelev_t *d, const uint8_t *a1, const uint8_t *sgd
 		if (d2 != 0xFFFF) {
 			d2 &= ~0x8000;
 			assert(d2 < sgdCount);
-			const uint8_t *a4 = sgd;
-			int d3 = (int32_t)READ_BE_UINT32(a4 + d2 * 4);
-			if (d3 < 0) {
-				d3 = -d3;
-				a4 += d3;
-				d3 = READ_BE_UINT16(a4); a4 += 2;
-				if (tileNum != d2) {
-					tileNum = d2;
-					memcpy(d->sgdDecodeBuf, a4, d3);
-					len = d3;
-				}
-			} else {
-				a4 += d3;
-				if (tileNum != d2) {
-					tileNum = d2;
-					len = decodeRLE(a4, d->sgdDecodeBuf);
-				}
+			struct arenamark_t mark;
+			markArena(d->arena, &mark);
+			const uint8_t *a0 = loadShape(d, sgd, d2, &len);
+			if (!a0) {
+				--count;
+				continue;
 			}
 			if (kFixLevel1Room26PlantYPos && d->level == 0 && d->room == 26 && d2 == 38) {
 				y_pos += 8;
 			}
-			const uint8_t *a0 = d->sgdDecodeBuf;
 			d2 = a0[0];
 			++d2; // w
 			d2 >>= 1;
@@ -250,6 +289,7 @@ static void loadSGD(struct decodelev_t *d, const uint8_t *a1, const uint8_t *sgd
 			const uint8_t *mask = a0 + size + 4;
 			assert(len == size * 5 + 4);
 			decodeTileSGD(d->roomBitmap, kRoomW, x_pos, y_pos, d2, d3, src, mask, size);
+			releaseArena(d->arena, &mark);
 		}
 		--count;
 	} while (count >= 0);
@@ -268,29 +308,14 @@ static void dumpSGD(struct decodelev_t *d, const uint8_t *sgd) {
 	int d3, d2, len;
 
 	const int count = (READ_BE_UINT32(sgd) / 4) - 1; /* last offset is end of file */
-	int tileNum = -1;
 
 	for (int num = 0; num < count; ++num) {
-		const uint8_t *a4 = sgd;
-		d2 = num;
-		d3 = READ_BE_UINT32(a4 + d2 * 4);
-		if (d3 < 0) {
-			d3 = -d3;
-			a4 += d3;
-			d3 = READ_BE_UINT16(a4); a4 += 2;
-			if (tileNum != d2) {
-				tileNum = d2;
-				memcpy(d->sgdDecodeBuf, a4, d3);
-				len = d3;
-			}
-		} else {
-			a4 += d3;
-			if (tileNum != d2) {
-				tileNum = d2;
-				len = decodeRLE(a4, d->sgdDecodeBuf);
-			}
+		struct arenamark_t mark;
+		markArena(d->arena, &mark);
+		const uint8_t *a0 = loadShape(d, sgd, num, &len);
+		if (!a0) {
+			continue;
 		}
-		uint8_t *a0 = d->sgdDecodeBuf;
 		d2 = a0[0];
 		++d2; // w
 		d2 >>= 1;
@@ -306,20 +331,25 @@ static void dumpSGD(struct decodelev_t *d, const uint8_t *sgd) {
 		decodeTileSGD(d->roomBitmap, w, 0, 0, d2, d3, a5, a2, size);
 
 		char name[32];
-		snprintf(name, sizeof(name), "sgd%03d.bmp", num);
-		saveBMP(name, d->roomBitmap, w, h, d->roomPalette, 64);
+		snprintf(name, sizeof(name), "sgd%03d", num);
+		saveImage(name, d->roomBitmap, w, h, d->roomPalette, 64);
+		releaseArena(d->arena, &mark);
 	}
 }
 
-static void decodeLevRoom(struct decodelev_t *d, const char *name, const uint8_t *p, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd) {
+/* draws the room to 'bitmap', or to a bitmap allocated from the arena if 0 */
+static bool renderLevRoom(struct decodelev_t *d, const uint8_t *p, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, uint8_t *bitmap) {
 	d->sgd = false;
 	d->roomOffset12 = READ_BE_UINT16(p + 12);
 	if (p[1] == 0) {
 		d->roomOffset10 = READ_BE_UINT16(p + 10);
 	}
+	/* the tiles of the banks listed for the room, after an empty one */
 	int offset = READ_BE_UINT16(p + 14);
-	memset(d->uncompressedMbkBuffer, 0, 8 * 4);
-	int uncompressedMbkOffset = 32;
+	int uncompressedMbkSize = 32;
+	/* the whole banks stay locked until copied, past MAX_ROOM_BANKS they are locked again */
+	const struct mbkbank_t *banks[MAX_ROOM_BANKS];
+	int banksCount = 0;
 	bool end = false;
 	do {
 		int mbk_num = READ_BE_UINT16(p + offset); offset += 2;
@@ -327,21 +357,53 @@ static void decodeLevRoom(struct decodelev_t *d, const char *name, const uint8_t
 			mbk_num &= ~0x8000;
 			end = true;
 		}
-		const uint8_t *a6;
-		int len, size = (int16_t)READ_BE_UINT16(mbk + mbk_num * 6 + 4);
-		if (size < 0) {
-			size = -size;
-			len = READ_BE_UINT32(mbk + mbk_num * 6);
-			a6 = mbk + len;
+		const int count = p[offset++];
+		if (count == 255) {
+			const struct mbkbank_t *bank = lockMbkBank(mbk, mbk_num);
+			assert(bank);
+			uncompressedMbkSize += bank->count * 32;
+			if (banksCount < MAX_ROOM_BANKS) {
+				banks[banksCount++] = bank;
+			} else {
+				unlockMbkBank(bank);
+			}
 		} else {
-			len = READ_BE_UINT32(mbk + mbk_num * 6);
-			const int ret = bytekiller_unpack(d->tmp, DECODE_BUFSIZE, mbk, len);
-			assert(ret == 0);
-			a6 = d->tmp;
+			uncompressedMbkSize += (count + 1) * 32;
+			offset += count + 1;
+		}
+	} while (!end);
+	d->tilesCount = uncompressedMbkSize / 32;
+	reserveArena(d->arena, uncompressedMbkSize + d->tilesCount * (1 + 2 * 4 * 64) + kRoomW * kRoomH + 5 * 16);
+	d->uncompressedMbkBuffer = (uint8_t *)allocArena(d->arena, uncompressedMbkSize);
+	/* the tiles loaded for this room have to be expanded */
+	d->tilesState = (uint8_t *)callocArena(d->arena, d->tilesCount);
+	d->tiles = (uint8_t (*)[4][64])allocArena(d->arena, d->tilesCount * 4 * 64);
+	d->tilesMask = (uint8_t (*)[4][64])allocArena(d->arena, d->tilesCount * 4 * 64);
+	d->roomBitmap = bitmap ? bitmap : (uint8_t *)allocArena(d->arena, kRoomW * kRoomH);
+	if (!d->uncompressedMbkBuffer || !d->tilesState || !d->tiles || !d->tilesMask || !d->roomBitmap) {
+		for (int i = 0; i < banksCount; ++i) {
+			unlockMbkBank(banks[i]);
+		}
+		d->roomBitmap = 0;
+		return false;
+	}
+	offset = READ_BE_UINT16(p + 14);
+	memset(d->uncompressedMbkBuffer, 0, 8 * 4);
+	int uncompressedMbkOffset = 32;
+	int bankNum = 0;
+	end = false;
+	do {
+		int mbk_num = READ_BE_UINT16(p + offset); offset += 2;
+		if (mbk_num & 0x8000) {
+			mbk_num &= ~0x8000;
+			end = true;
 		}
 		const int count = p[offset++];
+		const struct mbkbank_t *bank = (count == 255 && bankNum < banksCount) ? banks[bankNum++] : lockMbkBank(mbk, mbk_num);
+		assert(bank);
+		const uint8_t *a6 = bank->data;
 		if (count == 255) {
-			size *= 32;
+			const int size = bank->count * 32;
 			memcpy(d->uncompressedMbkBuffer + uncompressedMbkOffset, a6, size);
 			uncompressedMbkOffset += size;
 		} else {
@@ -351,15 +413,15 @@ static void decodeLevRoom(struct decodelev_t *d, const char *name, const uint8_t
 				uncompressedMbkOffset += 32;
 			}
 		}
+		unlockMbkBank(bank);
 	} while (!end);
+	assert(uncompressedMbkOffset == uncompressedMbkSize);
 	memset(d->roomBitmap, 0, kRoomW * kRoomH);
 	if (p[1] != 0) {
 		offset = READ_BE_UINT16(p + 10);
 		loadSGD(d, p + offset, sgd);
 		d->sgd = true;
 	}
-	uint8_t *a1 = d->sgdDecodeBuf + 6;
-	memset(a1, 0xFF, kRoomH * 8 * 8);
 	decodeLevRoomHelper(d, p);
 	const uint8_t *palettes = p + 2;
 	for (int j = 0; j < 4; ++j) {
@@ -369,6 +431,10 @@ static void decodeLevRoom(struct decodelev_t *d, const char *name, const uint8_t
 			convertColor444(d->roomPalette, j * 16 + i, color);
 		}
 	}
+	return true;
+}
+
+static void saveLevRoom(struct decodelev_t *d, const char *name) {
 	if (kDrawPalettes) {
 		for (int j = 0; j < 4; ++j) {
 			for (int i = 0; i < 16; ++i) {
@@ -377,46 +443,586 @@ static void decodeLevRoom(struct decodelev_t *d, const char *name, const uint8_t
 		}
 	}
 	char filename[64];
-	snprintf(filename, sizeof(filename), "%s_room%02d.bmp", name, d->room);
-	saveBMP(filename, d->roomBitmap, kRoomW, kRoomH, d->roomPalette, 64);
+	snprintf(filename, sizeof(filename), "%s_room%02d", name, d->room);
+	saveImage(filename, d->roomBitmap, kRoomW, kRoomH, d->roomPalette, 64);
+}
+
+/* the rooms of a level laid out on a grid of room sized cells, following the CT links */
+struct levmap_t {
+	int w, h;
+	int8_t roomX[64], roomY[64]; /* -1 if not placed */
+	int8_t *cells; /* w x h, -1 if empty */
+	uint8_t *bitmaps; /* kRoomW x kRoomH for each room, the first level of the pyramid */
+	uint8_t palettes[64][16 * 3 * 4];
+	bool rendered[64];
+};
+
+struct levjob_t {
+	const char *name;
+	const uint8_t *lev, *mbk, *pal, *sgd;
+	struct sgdcache_t sgdCache;
+	int level;
+	int roomsCount;
+	uint8_t rooms[64];
+	int nextRoom;
+	struct levmap_t *map; /* rooms are drawn to the map tiles, the room files are the first level */
+};
+
+struct levworker_t {
+	struct levjob_t *job;
+	struct arena_t *arena; /* the decoder context arena for the calling thread, 0 for the others */
+};
 
-	if (kDumpSGD && sgd) {
-		dumpSGD(d, sgd);
+/* the room data is packed, ending at the offset read from the table */
+static uint8_t *unpackLevRoom(struct arena_t *arena, const uint8_t *lev, int room) {
+	const uint32_t end = READ_BE_UINT32(lev + 4 * room);
+	const uint32_t size = READ_BE_UINT32(lev + end - 4);
+	uint8_t *buf = (uint8_t *)allocArena(arena, size);
+	if (buf) {
+		const int ret = bytekiller_unpack(buf, size, lev, end);
+		assert(ret == 0);
 	}
+	return buf;
 }
 
-static void decodeLevRooms(struct decodelev_t *d, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd) {
-	uint32_t offsets[64];
-	for (int i = 0; i < 64; ++i) {
-		offsets[i] = READ_BE_UINT32(lev + 4 * i);
+/* the allocations made for the room are released once it is saved */
+static void decodeLevJobRoom(struct decodelev_t *d, struct levjob_t *job, int i) {
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "lev", job->map ? "lev_map_room" : "lev_room");
+	struct arenamark_t mark;
+	markArena(d->arena, &mark);
+	const int room = job->rooms[i];
+	addTraceArg(&scope, "level", job->level);
+	addTraceArg(&scope, "room", room);
+	uint8_t *buf = unpackLevRoom(d->arena, job->lev, room);
+	struct levmap_t *map = job->map;
+	d->room = room;
+	if (buf && renderLevRoom(d, buf, job->mbk, job->pal, job->sgd, map ? map->bitmaps + room * kRoomW * kRoomH : 0)) {
+		/* the room file is the tile of the first map level */
+		if (map) {
+			memcpy(map->palettes[room], d->roomPalette, sizeof(d->roomPalette));
+			map->rendered[room] = true;
+		}
+		saveLevRoom(d, job->name);
+		/* the shapes are dumped with the palette of the last room, the map tile is kept for the pyramid */
+		if (kDumpSGD && job->sgd && i == job->roomsCount - 1) {
+			if (map) {
+				d->roomBitmap = (uint8_t *)allocArena(d->arena, kRoomW * kRoomH);
+			}
+			if (d->roomBitmap) {
+				dumpSGD(d, job->sgd);
+			}
+		}
 	}
-	uint32_t offset_prev = 64 * 4;
+	releaseArena(d->arena, &mark);
+	endTraceScope(&scope);
+}
+
+static struct decodelev_t *allocLevDecoder(struct arena_t *arena, const struct levjob_t *job) {
+	struct decodelev_t *d = (struct decodelev_t *)callocArena(arena, sizeof(struct decodelev_t));
+	if (d) {
+		d->arena = arena;
+		d->level = job->level;
+		d->sgdCache = job->sgd ? &job->sgdCache : 0;
+	}
+	return d;
+}
+
+static void *decodeLevThread(void *arg) {
+	struct levworker_t *worker = (struct levworker_t *)arg;
+	struct levjob_t *job = worker->job;
+	struct arena_t local;
+	struct arena_t *arena = worker->arena;
+	if (!arena) {
+		initArena(&local);
+		arena = &local;
+	}
+	struct arenamark_t mark;
+	markArena(arena, &mark);
+	struct decodelev_t *d = allocLevDecoder(arena, job);
+	if (d) {
+		struct metricsscope_t scope;
+		beginMetricsScope(&scope, kMetricsLEV);
+		int i;
+		while ((i = __atomic_fetch_add(&job->nextRoom, 1, __ATOMIC_RELAXED)) < job->roomsCount) {
+			decodeLevJobRoom(d, job, i);
+		}
+		endMetricsScope(&scope);
+	}
+	releaseArena(arena, &mark);
+	if (arena == &local) {
+		freeArena(&local);
+	}
+	return 0;
+}
+
+/* a room is present if its data ends after the previous one */
+static bool isLevRoomPresent(const uint8_t *lev, int room) {
+	const uint32_t offset_prev = (room == 0) ? 64 * 4 : READ_BE_UINT32(lev + 4 * (room - 1));
+	if (offset_prev != 0) {
+		const int size = READ_BE_UINT32(lev + 4 * room) - offset_prev;
+		if (size != 0) {
+			assert(size < 4096);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void initLevJobRooms(struct levjob_t *job) {
+	job->roomsCount = 0;
 	for (int i = 0; i < 64; ++i) {
-		if (offset_prev != 0) {
-			const int size = offsets[i] - offset_prev;
-			if (size != 0) {
-				assert(size < 4096);
-				const int ret = bytekiller_unpack(d->decodeLevBuf, 4096, lev, offsets[i]);
-				assert(ret == 0);
-				d->room = i;
-				decodeLevRoom(d, name, d->decodeLevBuf, mbk, pal, sgd);
-			}
+		if (isLevRoomPresent(job->lev, i)) {
+			job->rooms[job->roomsCount++] = i;
 		}
-		offset_prev = offsets[i];
 	}
+	job->nextRoom = 0;
 }
 
-void decodeLEV(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd) {
-	struct decodelev_t *d = (struct decodelev_t *)calloc(1, sizeof(struct decodelev_t));
+static void decodeLevRooms(struct levjob_t *job, struct arena_t *arena, int threads) {
+	initLevJobRooms(job);
+	if (threads > job->roomsCount) {
+		threads = job->roomsCount;
+	}
+	pthread_t tids[MAX_LEV_THREADS];
+	struct levworker_t workers[MAX_LEV_THREADS];
+	int started = 0;
+	for (; started < threads - 1; ++started) {
+		workers[started].job = job;
+		workers[started].arena = 0;
+		if (pthread_create(&tids[started], 0, decodeLevThread, &workers[started]) != 0) {
+			break;
+		}
+	}
+	struct levworker_t worker;
+	worker.job = job;
+	worker.arena = arena;
+	decodeLevThread(&worker);
+	for (int i = 0; i < started; ++i) {
+		pthread_join(tids[i], 0);
+	}
+}
+
+static int findLevel(const char *name) {
+	for (int i = 0; kNames[i]; ++i) {
+		if (strncasecmp(name, kNames[i], strlen(kNames[i])) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* the shapes cache is shared by the rooms, read-only */
+static void initLevJob(struct levjob_t *job, struct arena_t *arena, int level, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd) {
+	job->name = kNames[level];
+	job->lev = lev;
+	job->mbk = mbk;
+	job->pal = pal;
+	job->sgd = sgd;
+	job->level = level;
+	job->map = 0;
+	if (sgd) {
+		struct metricsscope_t scope;
+		beginMetricsScope(&scope, kMetricsLEV);
+		initSgdCache(&job->sgdCache, arena, sgd);
+		endMetricsScope(&scope);
+	}
+}
+
+void decodeLEVCtx(struct decoder_t *decoder, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, int threads) {
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > MAX_LEV_THREADS) {
+		threads = MAX_LEV_THREADS;
+	}
+	const int level = findLevel(name);
+	if (level < 0) {
+		return;
+	}
+	countDecoderCall(kMetricsLEV);
+	struct arenamark_t mark;
+	markArena(&decoder->arena, &mark);
+	struct levjob_t job;
+	initLevJob(&job, &decoder->arena, level, lev, mbk, pal, sgd);
+	decodeLevRooms(&job, &decoder->arena, threads);
+	releaseArena(&decoder->arena, &mark);
+}
+
+bool renderLEVRoom(struct decoder_t *decoder, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, int room, uint8_t *bitmap, uint8_t *palette) {
+	const int level = findLevel(name);
+	if (level < 0 || room < 0 || room >= 64 || !isLevRoomPresent(lev, room)) {
+		return false;
+	}
+	countDecoderCall(kMetricsLEV);
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsLEV);
+	struct arenamark_t mark;
+	markArena(&decoder->arena, &mark);
+	bool ret = false;
+	struct decodelev_t *d = (struct decodelev_t *)callocArena(&decoder->arena, sizeof(struct decodelev_t));
 	if (d) {
-		for (int i = 0; kNames[i]; ++i) {
-			const int len = strlen(kNames[i]);
-			if (strncasecmp(name, kNames[i], len) == 0) {
-				d->level = i;
-				decodeLevRooms(d, kNames[i], lev, mbk, pal, sgd);
-				break;
+		d->arena = &decoder->arena;
+		d->level = level;
+		d->room = room;
+		/* the shapes are decoded when drawn, only the ones of the room */
+		d->sgdCache = 0;
+		const uint8_t *p = unpackLevRoom(d->arena, lev, room);
+		if (p && renderLevRoom(d, p, mbk, pal, sgd, bitmap)) {
+			memcpy(palette, d->roomPalette, sizeof(d->roomPalette));
+			ret = true;
+		}
+	}
+	releaseArena(&decoder->arena, &mark);
+	endMetricsScope(&scope);
+	return ret;
+}
+
+/* offsets in the CT data of the rooms linked to each room, negative if none */
+static const int kCtLinks[4][3] = {
+	{ 0x00,  0, -1 }, /* up */
+	{ 0x40,  0,  1 }, /* down */
+	{ 0x80,  1,  0 }, /* right */
+	{ 0xC0, -1,  0 }, /* left */
+};
+
+#define CT_SIZE 0x1D00
+
+/* each group of linked rooms is laid out from its first room, the groups are placed side by side with an empty column in between */
+static bool layoutLevMap(struct levmap_t *map, struct arena_t *arena, const uint8_t *lev, const uint8_t *ct) {
+	int x[64], y[64];
+	uint8_t queue[64];
+	memset(map->roomX, -1, sizeof(map->roomX));
+	memset(map->roomY, -1, sizeof(map->roomY));
+	bool placed[64] = { false };
+	map->w = map->h = 0;
+	for (int first = 0; first < 64; ++first) {
+		if (placed[first] || !isLevRoomPresent(lev, first)) {
+			continue;
+		}
+		int count = 0;
+		queue[count++] = first;
+		placed[first] = true;
+		x[first] = y[first] = 0;
+		int xMin = 0, yMin = 0, xMax = 0, yMax = 0;
+		for (int i = 0; i < count; ++i) {
+			const int room = queue[i];
+			for (int j = 0; j < 4; ++j) {
+				const int next = (int8_t)ct[kCtLinks[j][0] + room];
+				if (next < 0 || next >= 64 || placed[next] || !isLevRoomPresent(lev, next)) {
+					continue;
+				}
+				const int nx = x[room] + kCtLinks[j][1];
+				const int ny = y[room] + kCtLinks[j][2];
+				/* links not consistent with the grid, the room starts its own group */
+				bool used = false;
+				for (int k = 0; k < count; ++k) {
+					if (x[queue[k]] == nx && y[queue[k]] == ny) {
+						used = true;
+						break;
+					}
+				}
+				if (used) {
+					continue;
+				}
+				x[next] = nx;
+				y[next] = ny;
+				placed[next] = true;
+				queue[count++] = next;
+				if (nx < xMin) xMin = nx;
+				if (nx > xMax) xMax = nx;
+				if (ny < yMin) yMin = ny;
+				if (ny > yMax) yMax = ny;
 			}
 		}
-		free(d);
+		const int x0 = (map->w == 0) ? 0 : map->w + 1;
+		for (int i = 0; i < count; ++i) {
+			const int room = queue[i];
+			map->roomX[room] = x0 + x[room] - xMin;
+			map->roomY[room] = y[room] - yMin;
+		}
+		map->w = x0 + xMax - xMin + 1;
+		if (map->h < yMax - yMin + 1) {
+			map->h = yMax - yMin + 1;
+		}
+	}
+	if (map->w == 0) {
+		return false;
+	}
+	map->cells = (int8_t *)allocArena(arena, map->w * map->h);
+	if (!map->cells) {
+		return false;
+	}
+	memset(map->cells, -1, map->w * map->h);
+	for (int room = 0; room < 64; ++room) {
+		if (map->roomX[room] >= 0) {
+			map->cells[map->roomY[room] * map->w + map->roomX[room]] = room;
+		}
+	}
+	return true;
+}
+
+/* averages 2x2 pixels of a child tile to a quarter of 'dst', 'pal' is set if 'src' is indexed */
+static void downsampleMapTile(uint8_t *dst, int qx, int qy, const uint8_t *src, const uint8_t *pal) {
+	const int bpp = pal ? 1 : 3;
+	dst += (qy * kRoomH / 2 * kRoomW + qx * kRoomW / 2) * 3;
+	for (int y = 0; y < kRoomH / 2; ++y) {
+		const uint8_t *row0 = src + (2 * y) * kRoomW * bpp;
+		const uint8_t *row1 = row0 + kRoomW * bpp;
+		for (int x = 0; x < kRoomW / 2; ++x) {
+			for (int c = 0; c < 3; ++c) {
+				int sum;
+				if (pal) {
+					sum = pal[row0[2 * x] * 3 + c] + pal[row0[2 * x + 1] * 3 + c] + pal[row1[2 * x] * 3 + c] + pal[row1[2 * x + 1] * 3 + c];
+				} else {
+					sum = row0[6 * x + c] + row0[6 * x + 3 + c] + row1[6 * x + c] + row1[6 * x + 3 + c];
+				}
+				dst[x * 3 + c] = (sum + 2) >> 2;
+			}
+		}
+		dst += kRoomW * 3;
+	}
+}
+
+/* each level halves the previous one until a single tile covers the map, returns the number of levels */
+static int saveLevMapPyramid(struct arena_t *arena, const char *name, const struct levmap_t *map) {
+	int w = map->w;
+	int h = map->h;
+	int levels = 1; /* the room files */
+	uint8_t **prev = 0;
+	while (w > 1 || h > 1) {
+		const int tw = (w + 1) / 2;
+		const int th = (h + 1) / 2;
+		uint8_t **tiles = (uint8_t **)callocArena(arena, tw * th * sizeof(uint8_t *));
+		if (!tiles) {
+			break;
+		}
+		for (int ty = 0; ty < th; ++ty) {
+			for (int tx = 0; tx < tw; ++tx) {
+				uint8_t *tile = 0;
+				for (int q = 0; q < 4; ++q) {
+					const int cx = 2 * tx + (q & 1);
+					const int cy = 2 * ty + (q >> 1);
+					if (cx >= w || cy >= h) {
+						continue;
+					}
+					const uint8_t *src = 0;
+					const uint8_t *pal = 0;
+					if (!prev) {
+						const int room = map->cells[cy * w + cx];
+						if (room >= 0 && map->rendered[room]) {
+							src = map->bitmaps + room * kRoomW * kRoomH;
+							pal = map->palettes[room];
+						}
+					} else {
+						src = prev[cy * w + cx];
+					}
+					if (!src) {
+						continue;
+					}
+					if (!tile) {
+						tile = (uint8_t *)callocArena(arena, kRoomW * kRoomH * 3);
+						if (!tile) {
+							break;
+						}
+					}
+					downsampleMapTile(tile, q & 1, q >> 1, src, pal);
+				}
+				if (tile) {
+					char filename[64];
+					snprintf(filename, sizeof(filename), "%s_map_%d_%d_%d", name, levels, tx, ty);
+					saveImageRGB(filename, tile, kRoomW, kRoomH);
+				}
+				tiles[ty * tw + tx] = tile;
+			}
+		}
+		prev = tiles;
+		w = tw;
+		h = th;
+		++levels;
+	}
+	return levels;
+}
+
+static void saveLevMapJson(const char *name, const struct levmap_t *map, int levels) {
+	char *json = 0;
+	size_t jsonSize = 0;
+	FILE *fp = open_memstream(&json, &jsonSize);
+	if (fp) {
+		fprintf(fp, "{\n\t\"tile_w\": %d,\n\t\"tile_h\": %d,\n", kRoomW, kRoomH);
+		/* the level 0 tiles are the room files, listed with the rooms */
+		fprintf(fp, "\t\"tiles\": \"%s_map_{level}_{x}_{y}.%s\",\n", name, getImageExtension());
+		fprintf(fp, "\t\"levels\": [\n");
+		int w = map->w;
+		int h = map->h;
+		for (int i = 0; i < levels; ++i) {
+			fprintf(fp, "\t\t{ \"level\": %d, \"scale\": %d, \"w\": %d, \"h\": %d }%s\n", i, 1 << i, w, h, (i < levels - 1) ? "," : "");
+			w = (w + 1) / 2;
+			h = (h + 1) / 2;
+		}
+		fprintf(fp, "\t],\n\t\"rooms\": [\n");
+		int count = 0;
+		for (int room = 0; room < 64; ++room) {
+			count += map->rendered[room];
+		}
+		for (int room = 0; room < 64; ++room) {
+			if (map->rendered[room]) {
+				--count;
+				fprintf(fp, "\t\t{ \"room\": %d, \"x\": %d, \"y\": %d, \"file\": \"%s_room%02d.%s\" }%s\n", room, map->roomX[room], map->roomY[room], name, room, getImageExtension(), (count > 0) ? "," : "");
+			}
+		}
+		fprintf(fp, "\t]\n}\n");
+		fclose(fp);
+		char filename[64];
+		snprintf(filename, sizeof(filename), "%s_map.json", name);
+		writeOutputFile(filename, (const uint8_t *)json, jsonSize);
+	}
+	free(json);
+}
+
+/* returns 0 if the CT data is not valid */
+static struct levmap_t *allocLevMap(struct arena_t *arena, const uint8_t *lev, const uint8_t *ct, uint32_t ctSize) {
+	if (ctSize < 4 || READ_BE_UINT32(ct + ctSize - 4) != CT_SIZE) {
+		return 0;
+	}
+	uint8_t *ctData = (uint8_t *)allocArena(arena, CT_SIZE);
+	struct levmap_t *map = (struct levmap_t *)callocArena(arena, sizeof(struct levmap_t));
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsLEV);
+	const bool laidOut = ctData && map && bytekiller_unpack(ctData, CT_SIZE, ct, ctSize) == 0 && layoutLevMap(map, arena, lev, ctData);
+	endMetricsScope(&scope);
+	if (!laidOut) {
+		return 0;
+	}
+	map->bitmaps = (uint8_t *)allocArena(arena, 64 * kRoomW * kRoomH);
+	return map->bitmaps ? map : 0;
+}
+
+void decodeLEVMapCtx(struct decoder_t *decoder, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize, int threads) {
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > MAX_LEV_THREADS) {
+		threads = MAX_LEV_THREADS;
+	}
+	const int level = findLevel(name);
+	if (level < 0) {
+		return;
+	}
+	countDecoderCall(kMetricsLEV);
+	struct arenamark_t mark;
+	markArena(&decoder->arena, &mark);
+	/* the rooms are still saved if the CT data is not valid */
+	struct levmap_t *map = allocLevMap(&decoder->arena, lev, ct, ctSize);
+	struct levjob_t job;
+	initLevJob(&job, &decoder->arena, level, lev, mbk, pal, sgd);
+	job.map = map;
+	decodeLevRooms(&job, &decoder->arena, threads);
+	if (map) {
+		struct metricsscope_t scope;
+		beginMetricsScope(&scope, kMetricsLEV);
+		const int levels = saveLevMapPyramid(&decoder->arena, job.name, map);
+		saveLevMapJson(job.name, map, levels);
+		endMetricsScope(&scope);
+	}
+	releaseArena(&decoder->arena, &mark);
+}
+
+void decodeLEVMap(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize, int threads) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeLEVMapCtx(decoder, name, lev, mbk, pal, sgd, ct, ctSize, threads);
+		freeDecoder(decoder);
+	}
+}
+
+void decodeLEVThreads(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, int threads) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeLEVCtx(decoder, name, lev, mbk, pal, sgd, threads);
+		freeDecoder(decoder);
+	}
+}
+
+void decodeLEV(const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd) {
+	decodeLEVThreads(name, lev, mbk, pal, sgd, 1);
+}
+
+struct levroomtask_t {
+	struct levtask_t *task;
+	int num;
+};
+
+/* the state shared by the room tasks of a level is freed with the last one */
+struct levtask_t {
+	struct arena_t arena;
+	struct levjob_t job;
+	struct taskgroup_t group;
+	struct levroomtask_t rooms[64];
+};
+
+static void runLevRoomTask(struct taskworker_t *worker, void *arg) {
+	const struct levroomtask_t *room = (const struct levroomtask_t *)arg;
+	struct arena_t *arena = &worker->decoder->arena;
+	struct arenamark_t mark;
+	markArena(arena, &mark);
+	struct decodelev_t *d = allocLevDecoder(arena, &room->task->job);
+	if (d) {
+		struct metricsscope_t scope;
+		beginMetricsScope(&scope, kMetricsLEV);
+		decodeLevJobRoom(d, &room->task->job, room->num);
+		endMetricsScope(&scope);
+	}
+	releaseArena(arena, &mark);
+}
+
+static void finishLevTask(struct taskworker_t *worker, void *arg) {
+	struct levtask_t *task = (struct levtask_t *)arg;
+	if (task->job.map) {
+		struct arena_t *arena = &worker->decoder->arena;
+		struct arenamark_t mark;
+		markArena(arena, &mark);
+		struct metricsscope_t scope;
+		beginMetricsScope(&scope, kMetricsLEV);
+		const int levels = saveLevMapPyramid(arena, task->job.name, task->job.map);
+		saveLevMapJson(task->job.name, task->job.map, levels);
+		endMetricsScope(&scope);
+		releaseArena(arena, &mark);
+	}
+	freeArena(&task->arena);
+	free(task);
+}
+
+static void spawnLevRoomTasks(struct taskworker_t *worker, int level, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize) {
+	struct levtask_t *task = (struct levtask_t *)malloc(sizeof(struct levtask_t));
+	if (!task) {
+		return;
+	}
+	initArena(&task->arena);
+	/* the rooms are still saved if the CT data is not valid */
+	struct levmap_t *map = ct ? allocLevMap(&task->arena, lev, ct, ctSize) : 0;
+	initLevJob(&task->job, &task->arena, level, lev, mbk, pal, sgd);
+	task->job.map = map;
+	initLevJobRooms(&task->job);
+	openTaskGroup(&task->group, finishLevTask, task);
+	for (int i = 0; i < task->job.roomsCount; ++i) {
+		task->rooms[i].task = task;
+		task->rooms[i].num = i;
+		spawnTask(worker, &task->group, runLevRoomTask, &task->rooms[i]);
+	}
+	closeTaskGroup(worker, &task->group);
+}
+
+void spawnLEVTasks(struct taskworker_t *worker, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize, int flags) {
+	const int level = findLevel(name);
+	if (level < 0) {
+		return;
+	}
+	countDecoderCall(kMetricsLEV);
+	/* each room is rendered once, to its map tile with kDecodeLevelMap */
+	if ((flags & kDecodeLevelMap) != 0 && ct) {
+		spawnLevRoomTasks(worker, level, lev, mbk, pal, sgd, ct, ctSize);
+	} else {
+		spawnLevRoomTasks(worker, level, lev, mbk, pal, sgd, 0, 0);
 	}
 }
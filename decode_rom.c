@@ -0,0 +1,104 @@
+
+#include "decode.h"
+#include "task.h"
+
+struct assettask_t {
+	const struct romtask_t *rom;
+	const struct decodeasset_t *asset;
+};
+
+struct romtask_t {
+	const struct decodeasset_t *assets;
+	int count;
+	int flags;
+	struct assettask_t *tasks;
+};
+
+static const struct decodeasset_t *findRomAsset(const struct romtask_t *rom, const char *name) {
+	for (int i = 0; i < rom->count; ++i) {
+		if (strcmp(rom->assets[i].name, name) == 0) {
+			return &rom->assets[i];
+		}
+	}
+	return 0;
+}
+
+static const uint8_t *getRomAssetData(const struct romtask_t *rom, const char *name) {
+	const struct decodeasset_t *asset = findRomAsset(rom, name);
+	return asset ? asset->data : 0;
+}
+
+/* the assets read by each decoder are looked up by name */
+static void runAssetTask(struct taskworker_t *worker, void *arg) {
+	const struct assettask_t *task = (const struct assettask_t *)arg;
+	const struct romtask_t *rom = task->rom;
+	const struct decodeasset_t *asset = task->asset;
+	char name[32];
+	snprintf(name, sizeof(name), "%s", asset->name);
+	char *ext = strchr(name, '.');
+	if (!ext) {
+		decodeCtx(worker->decoder, asset->name, asset->data, asset->size);
+		return;
+	}
+	*ext++ = 0;
+	char filename[40];
+	if (strcmp(ext, "LEV") == 0) {
+		snprintf(filename, sizeof(filename), "%s.MBK", name);
+		const uint8_t *mbk = getRomAssetData(rom, filename);
+		snprintf(filename, sizeof(filename), "%s.PAL", name);
+		const uint8_t *pal = getRomAssetData(rom, filename);
+		const uint8_t *sgd = 0;
+		if (strcmp(name, "LEVEL1") == 0) {
+			snprintf(filename, sizeof(filename), "%s.SGD", name);
+			sgd = getRomAssetData(rom, filename);
+		}
+		snprintf(filename, sizeof(filename), "%s.CT", name);
+		const struct decodeasset_t *ct = findRomAsset(rom, filename);
+		if (mbk && pal) {
+			spawnLEVTasks(worker, asset->name, asset->data, mbk, pal, sgd, ct ? ct->data : 0, ct ? ct->size : 0, rom->flags);
+		}
+	} else if (strcmp(ext, "RP") == 0) {
+		const uint8_t *spc = getRomAssetData(rom, "GLOBAL.SPC");
+		const uint8_t *mbk = getRomAssetData(rom, "SPC.MBK");
+		if (spc && mbk) {
+			decodeRPCtx(worker->decoder, asset->name, asset->data, spc, mbk);
+		}
+	} else if (strcmp(asset->name, "GLOBAL.SPC") == 0) {
+		const uint8_t *mbk = getRomAssetData(rom, "SPC.MBK");
+		if (mbk) {
+			spawnSPCTasks(worker, asset->name, asset->data, mbk);
+		}
+	} else if (strcmp(asset->name, "GLOBAL.SPR") == 0) {
+		const uint8_t *tab = getRomAssetData(rom, "GLOBAL.TAB");
+		if (tab) {
+			spawnSPRTasks(worker, asset->name, asset->data, tab, rom->flags);
+		}
+	} else {
+		decodeCtx(worker->decoder, asset->name, asset->data, asset->size);
+	}
+}
+
+/* the asset tasks spawn their own tasks, the read-only inputs they share stay valid until runTasks returns */
+static void spawnAssetTasks(struct taskworker_t *worker, void *arg) {
+	struct romtask_t *rom = (struct romtask_t *)arg;
+	for (int i = 0; i < rom->count; ++i) {
+		spawnTask(worker, 0, runAssetTask, &rom->tasks[i]);
+	}
+}
+
+void decodeROM(const struct decodeasset_t *assets, int count, int flags, int threads, struct decodestats_t *stats) {
+	struct romtask_t rom;
+	rom.assets = assets;
+	rom.count = count;
+	rom.flags = flags;
+	rom.tasks = (struct assettask_t *)malloc(count * sizeof(struct assettask_t));
+	if (!rom.tasks) {
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		rom.tasks[i].rom = &rom;
+		rom.tasks[i].asset = &assets[i];
+	}
+	runTasks(threads, spawnAssetTasks, &rom, stats);
+	free(rom.tasks);
+}
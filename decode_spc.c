@@ -1,5 +1,11 @@
 
 #include "bitmap.h"
+#include "decode.h"
+#include "mbk.h"
+#include "metrics.h"
+#include "task.h"
+#include "tile.h"
+#include "trace.h"
 #include "unpack.h"
 
 static const uint8_t kSprHeader[] = { 0x53, 0x50, 0x54, 0x00, 0x05, 0x07, 0x00, 0x02, 0x00, 0x20, 0x00, 0x18 };
@@ -54,43 +60,23 @@ static const struct monster_t {
 static const int kMbkCount = 84;
 static const int kSprCount = 1287;
 
-static uint8_t _buffer[0xFFFFF];
-static uint8_t _bitmap[256 * 256];
-
-static int decodeMBK(const uint8_t *mbk, int i) {
-	uint32_t mbk_offset = READ_BE_UINT32(mbk + i * 6);
-	uint16_t count = READ_BE_UINT16(mbk + i * 6 + 4);
-	assert((count & 0x8000) == 0);
-	uint32_t uncompressed = READ_BE_UINT32(mbk + mbk_offset - 4);
-	// fprintf(stdout, "mbk:%d offset 0x%x size %d %d uncompressed %d\n", i, mbk_offset, count, count * 32, uncompressed);
-	assert(uncompressed == 32 * count);
-	int ret = bytekiller_unpack(_buffer, sizeof(_buffer), mbk, mbk_offset);
-	assert(ret == 0);
-	return count;
-}
-
-static void decodeTile8x8(const uint8_t *src, int x, int y, uint8_t *dst, int dstPitch) {
-	dst += y * dstPitch + x;
-	for (int j = 0; j < 8; ++j) {
-		for (int i = 0; i < 4; ++i) {
-			const uint8_t color = *src++;
-			dst[i * 2]     = color >> 4;
-			dst[i * 2 + 1] = color & 15;
-		}
-		dst += dstPitch;
-	}
+static const struct mbkbank_t *lockSpcBank(const uint8_t *mbk, int i) {
+	const struct mbkbank_t *bank = lockMbkBank(mbk, i);
+	// fprintf(stdout, "mbk:%d size %d %d uncompressed %d\n", i, bank->count, bank->count * 32, bank->size);
+	assert(bank && bank->size == 32 * bank->count);
+	return bank;
 }
 
 static void decodeSpcHelper(const uint8_t *src, int W, int H, uint8_t *bitmap, int dstPitch) {
 	for (int x = 0; x < W; x += 8) {
 		for (int y = 0; y < H; y += 8) {
-			decodeTile8x8(src, x, y, bitmap, dstPitch);
+			expandTile8x8(bitmap + y * dstPitch + x, dstPitch, src, 0);
 			src += 8 * 8 / 2;
 		}
 	}
 }
 
-void decodeSPC(const char *name, const uint8_t *spc, const uint8_t *mbk) {
+static void checkSpcTable(const uint8_t *spc) {
 	const int count = READ_BE_UINT16(spc) / 2;
 	uint32_t prev_offset = READ_BE_UINT16(spc);
 	uint32_t next_offset = 0;
@@ -107,21 +93,53 @@ void decodeSPC(const char *name, const uint8_t *spc, const uint8_t *mbk) {
 		prev_offset = offset;
 		next_offset = offset + 6 + sz * 4;
 	}
+}
+
+static void decodeSpcBank(struct arena_t *arena, const uint8_t *mbk, int num) {
 	uint8_t palette[16 * 3];
 	for (int i = 0; i < 16; ++i) {
 		palette[i * 3] = palette[i * 3 + 1] = palette[i * 3 + 2] = (i << 4) | i;
 	}
-	for (int i = 0; i < kMbkCount; ++i) {
-		const int count = decodeMBK(mbk, i);
-		decodeSpcHelper(_buffer, count * 8, 8, _bitmap, count * 8);
+	struct arenamark_t mark;
+	markArena(arena, &mark);
+	const struct mbkbank_t *bank = lockSpcBank(mbk, num);
+	const int count = bank->count;
+	uint8_t *bitmap = (uint8_t *)allocArena(arena, count * 8 * 8);
+	if (bitmap) {
+		decodeSpcHelper(bank->data, count * 8, 8, bitmap, count * 8);
+	}
+	unlockMbkBank(bank);
 
+	if (bitmap) {
 		char filename[64];
-		snprintf(filename, sizeof(filename), "mbk%03d.bmp", i);
-		saveBMP(filename, _bitmap, count * 8, 8, palette, 16);
+		snprintf(filename, sizeof(filename), "mbk%03d", num);
+		saveImage(filename, bitmap, count * 8, 8, palette, 16);
 	}
+	releaseArena(arena, &mark);
 }
 
-void decodeRP(const char *name, const uint8_t *rp, const uint8_t *spc, const uint8_t *mbk) {
+void decodeSPCCtx(struct decoder_t *decoder, const char *name, const uint8_t *spc, const uint8_t *mbk) {
+	countDecoderCall(kMetricsSPC);
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsSPC);
+	checkSpcTable(spc);
+	for (int i = 0; i < kMbkCount; ++i) {
+		decodeSpcBank(&decoder->arena, mbk, i);
+	}
+	endMetricsScope(&scope);
+}
+
+void decodeRPCtx(struct decoder_t *decoder, const char *name, const uint8_t *rp, const uint8_t *spc, const uint8_t *mbk) {
+	countDecoderCall(kMetricsRP);
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsRP);
+	struct arenamark_t mark;
+	markArena(&decoder->arena, &mark);
+	uint8_t *bitmap = (uint8_t *)allocArena(&decoder->arena, 256 * 256);
+	if (!bitmap) {
+		endMetricsScope(&scope);
+		return;
+	}
 	const int count = READ_BE_UINT16(spc) / 2;
 	for (int i = 0; i < count; ++i) {
 		const uint16_t offset = READ_BE_UINT16(spc + i * 2);
@@ -133,11 +151,9 @@ void decodeRP(const char *name, const uint8_t *rp, const uint8_t *spc, const uin
 		//const int8_t offs_y = (int8_t)p[2];
 		const int sz = p[5];
 		p += 6;
-		//uint32_t mbk_offset = READ_BE_UINT32(mbk + mbk_num * 6);
-		uint16_t count = READ_BE_UINT16(mbk + mbk_num * 6 + 4);
-		//uint32_t uncompressed = READ_BE_UINT32(mbk + mbk_offset - 4);
-		decodeMBK(mbk, mbk_num);
-		memset(_bitmap, 0, sizeof(_bitmap));
+		const struct mbkbank_t *bank = lockSpcBank(mbk, mbk_num);
+		const int count = bank->count;
+		memset(bitmap, 0, 256 * 256);
 		for (int j = 0; j < sz; ++j, p += 4) {
 			int tile_num = p[0];
 			if (tile_num >= count) {
@@ -148,66 +164,454 @@ void decodeRP(const char *name, const uint8_t *rp, const uint8_t *spc, const uin
 			uint8_t sprite_flags = p[3];
 			uint8_t sprite_h = (((sprite_flags >> 0) & 3) + 1) * 8;
 			uint8_t sprite_w = (((sprite_flags >> 2) & 3) + 1) * 8;
-			decodeSpcHelper(_buffer + tile_num * 32, sprite_w, sprite_h, _bitmap + sprite_y * 256 + sprite_x, 256);
+			decodeSpcHelper(bank->data + tile_num * 32, sprite_w, sprite_h, bitmap + sprite_y * 256 + sprite_x, 256);
 		}
+		unlockMbkBank(bank);
 	}
+	releaseArena(&decoder->arena, &mark);
+	endMetricsScope(&scope);
 }
 
-static void decodeSprHelper(const uint8_t *src, const char *name, const uint8_t *palette) {
-        static const int W = 32;
-        static const int H = 24;
-        uint8_t *bitmap = (uint8_t *)malloc(W * H * 2);
-        if (bitmap) {
-		for (int part = 0; part < 2; ++part) { /* top, bottom */
-			for (int x = 0; x < W; x += 8) {
-				for (int y = 0; y < H; y += 8) {
-					decodeTile8x8(src, x, y, bitmap + part * W * H, W);
-					src += 8 * 8 / 2;
-				}
+static const int kSprW = 32;
+static const int kSprH = 48;
+
+/* 4 bits per pixel */
+#define SPR_FRAME_SIZE (32 * 48 / 2)
+
+static void decodeSprHelper(const uint8_t *src, uint8_t *bitmap) {
+	static const int W = 32;
+	static const int H = 24;
+	for (int part = 0; part < 2; ++part) { /* top, bottom */
+		for (int x = 0; x < W; x += 8) {
+			for (int y = 0; y < H; y += 8) {
+				expandTile8x8(bitmap + part * W * H + y * W + x, W, src, 0);
+				src += 8 * 8 / 2;
 			}
 		}
-		saveBMP(name, bitmap, W, H * 2, palette, 16);
-		free(bitmap);
 	}
 }
 
-void decodeSPR(const char *name, const uint8_t *spr, const uint8_t *tab) {
-	assert(memcmp(spr, kSprHeader, sizeof(kSprHeader)) == 0);
-	int current_monster = 0;
-	for (int i = 0; i < kSprCount; ++i) {
-		const uint32_t offset = READ_BE_UINT32(tab + i * 4) + sizeof(kSprHeader);
-		const uint8_t *p = spr + offset;
-		// const int8_t dx = p[0]; // horizontal position
-		// const int8_t dy = p[1]; // vertical position
-		uint16_t len = READ_BE_UINT16(p + 2) + 1;
-		p += 4;
-		memset(_buffer, 0, sizeof(_buffer));
-		int uncompressed = 0;
-		for (int j = 0; j < len; ++j) {
-			if ((p[j] & 0xF0) == 0xF0) {
-				const uint8_t color = p[j] & 15;
-				++j;
-				const int count = p[j] + 1;
-				memset(_buffer + uncompressed, (color << 4) | color, count);
-				uncompressed += count;
-			} else {
-				assert((p[j] & 15) != 15);
-				_buffer[uncompressed] = p[j];
+static const struct monster_t *findMonster(int num) {
+	for (int i = 0; kMonsters[i].name; ++i) {
+		if (num >= kMonsters[i].start && num <= kMonsters[i].end) {
+			return &kMonsters[i];
+		}
+	}
+	return 0;
+}
+
+/* decodes sprite 'num' to a kSprW x kSprH bitmap, 'buffer' holds SPR_FRAME_SIZE bytes */
+static void decodeSprFrame(const uint8_t *spr, const uint8_t *tab, int num, uint8_t *buffer, uint8_t *bitmap, int *dx, int *dy) {
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "spr", "spr_frame");
+	const uint32_t offset = READ_BE_UINT32(tab + num * 4) + sizeof(kSprHeader);
+	const uint8_t *p = spr + offset;
+	*dx = (int8_t)p[0]; // horizontal position
+	*dy = (int8_t)p[1]; // vertical position
+	uint16_t len = READ_BE_UINT16(p + 2) + 1;
+	p += 4;
+	int uncompressed = 0;
+	uint32_t runs = 0, runBytes = 0;
+	for (int j = 0; j < len; ++j) {
+		if ((p[j] & 0xF0) == 0xF0) {
+			const uint8_t color = p[j] & 15;
+			++j;
+			int count = p[j] + 1;
+			++runs;
+			runBytes += count;
+			if (uncompressed + count > SPR_FRAME_SIZE) { /* only the frame pixels are used */
+				count = (uncompressed < SPR_FRAME_SIZE) ? SPR_FRAME_SIZE - uncompressed : 0;
+			}
+			memset(buffer + uncompressed, (color << 4) | color, count);
+			uncompressed += count;
+		} else {
+			assert((p[j] & 15) != 15);
+			if (uncompressed < SPR_FRAME_SIZE) {
+				buffer[uncompressed] = p[j];
 				++uncompressed;
 			}
 		}
-		const char *name = "perso";
-		const uint8_t *palette = kPalettePerso;
-		if (i >= kMonsters[current_monster].start && i <= kMonsters[current_monster].end) {
-			palette = kMonsters[current_monster].palette;
-			name = kMonsters[current_monster].name;
-			if (i == kMonsters[current_monster].end) {
-				++current_monster;
+	}
+	// fprintf(stdout, "spr %d offset 0x%x hdr:%d,%d len %d uncompressed %d\n", num, offset, *dx, *dy, len, uncompressed);
+	/* only the pixels not covered by the runs are cleared */
+	memset(buffer + uncompressed, 0, SPR_FRAME_SIZE - uncompressed);
+	countSprFrame(len + 4, runs, runBytes, len - runs * 2);
+	decodeSprHelper(buffer, bitmap);
+	addTraceArg(&scope, "frame", num);
+	addTraceArg(&scope, "size", len);
+	endTraceScope(&scope);
+}
+
+/* saves the sprites 'start' to 'end' - 1, one file each */
+static void saveSprFrames(struct arena_t *arena, const uint8_t *spr, const uint8_t *tab, int start, int end) {
+	struct arenamark_t mark;
+	markArena(arena, &mark);
+	uint8_t *buffer = (uint8_t *)allocArena(arena, SPR_FRAME_SIZE);
+	uint8_t *bitmap = (uint8_t *)allocArena(arena, kSprW * kSprH);
+	if (buffer && bitmap) {
+		for (int i = start; i < end; ++i) {
+			int dx, dy;
+			decodeSprFrame(spr, tab, i, buffer, bitmap, &dx, &dy);
+			const struct monster_t *m = findMonster(i);
+			char filename[64];
+			snprintf(filename, sizeof(filename), "spr%04d_%s", i, m ? m->name : "perso");
+			saveImage(filename, bitmap, kSprW, kSprH, m ? m->palette : kPalettePerso, 16);
+		}
+	}
+	releaseArena(arena, &mark);
+}
+
+void decodeSPRCtx(struct decoder_t *decoder, const char *name, const uint8_t *spr, const uint8_t *tab) {
+	assert(memcmp(spr, kSprHeader, sizeof(kSprHeader)) == 0);
+	countDecoderCall(kMetricsSPR);
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsSPR);
+	saveSprFrames(&decoder->arena, spr, tab, 0, kSprCount);
+	endMetricsScope(&scope);
+}
+
+#define SPR_ATLAS_COLUMNS 16
+#define SPR_ATLAS_COUNT 5 /* perso and kMonsters */
+
+struct sprframe_t {
+	uint8_t atlas;
+	uint16_t frame;
+	int8_t dx, dy;
+};
+
+struct spratlas_t {
+	const char *name;
+	const uint8_t *palette;
+	int count; /* unique frames */
+	uint8_t *frames; /* kSprW x kSprH each */
+	uint32_t *hashes;
+};
+
+static uint32_t hashFrame(const uint8_t *bitmap) {
+	uint32_t hash = 2166136261U; /* FNV-1a */
+	for (int i = 0; i < kSprW * kSprH; ++i) {
+		hash = (hash ^ bitmap[i]) * 16777619U;
+	}
+	return hash;
+}
+
+/* the frames are decoded to the slot following the stored ones */
+static uint8_t *getAtlasSlot(struct spratlas_t *atlas) {
+	return atlas->frames + atlas->count * kSprW * kSprH;
+}
+
+/* returns the frame index in the atlas, identical frames are only stored once */
+/* 'bitmap' is the next slot or, for frames decoded in advance, one past it and moved down when unique */
+static int addAtlasFrame(struct spratlas_t *atlas, const uint8_t *bitmap) {
+	const int frameSize = kSprW * kSprH;
+	const uint32_t hash = hashFrame(bitmap);
+	for (int i = 0; i < atlas->count; ++i) {
+		if (atlas->hashes[i] == hash && memcmp(atlas->frames + i * frameSize, bitmap, frameSize) == 0) {
+			return i;
+		}
+	}
+	uint8_t *slot = getAtlasSlot(atlas);
+	if (slot != bitmap) {
+		memcpy(slot, bitmap, frameSize);
+	}
+	atlas->hashes[atlas->count] = hash;
+	return atlas->count++;
+}
+
+/* returns the atlas of sprite 'num', 'slot' is its frame when the atlas ranges follow each other in one buffer, perso first */
+static int findSprAtlas(int num, int *slot) {
+	int offset = 0;
+	for (int i = 0; kMonsters[i].name; ++i) {
+		if (num > kMonsters[i].end) {
+			offset += kMonsters[i].end - kMonsters[i].start + 1;
+		}
+	}
+	const struct monster_t *m = findMonster(num);
+	if (!m) {
+		*slot = num - offset;
+		return 0;
+	}
+	/* the perso frames come first */
+	int persoCount = kSprCount;
+	for (int i = 0; kMonsters[i].name; ++i) {
+		persoCount -= kMonsters[i].end - kMonsters[i].start + 1;
+	}
+	*slot = persoCount;
+	for (int i = 0; &kMonsters[i] != m; ++i) {
+		*slot += kMonsters[i].end - kMonsters[i].start + 1;
+	}
+	*slot += num - m->start;
+	return (m - kMonsters) + 1;
+}
+
+static void saveAtlas(struct arena_t *arena, const struct spratlas_t *atlas, int *w, int *h) {
+	const int columns = (atlas->count < SPR_ATLAS_COLUMNS) ? atlas->count : SPR_ATLAS_COLUMNS;
+	const int rows = (atlas->count + SPR_ATLAS_COLUMNS - 1) / SPR_ATLAS_COLUMNS;
+	*w = columns * kSprW;
+	*h = rows * kSprH;
+	struct arenamark_t mark;
+	markArena(arena, &mark);
+	uint8_t *bitmap = (uint8_t *)callocArena(arena, *w * *h);
+	if (bitmap) {
+		for (int i = 0; i < atlas->count; ++i) {
+			const int x = (i % SPR_ATLAS_COLUMNS) * kSprW;
+			const int y = (i / SPR_ATLAS_COLUMNS) * kSprH;
+			const uint8_t *src = atlas->frames + i * kSprW * kSprH;
+			for (int j = 0; j < kSprH; ++j) {
+				memcpy(bitmap + (y + j) * *w + x, src + j * kSprW, kSprW);
 			}
 		}
-		// fprintf(stdout, "spr %d offset 0x%x hdr:%d,%d len %d uncompressed %d\n", i, offset, dx, dy, len, uncompressed);
 		char filename[64];
-		snprintf(filename, sizeof(filename), "spr%04d_%s.bmp", i, name);
-		decodeSprHelper(_buffer, filename, palette);
+		snprintf(filename, sizeof(filename), "spr_%s", atlas->name);
+		saveImage(filename, bitmap, *w, *h, atlas->palette, 16);
+	}
+	releaseArena(arena, &mark);
+}
+
+/* packs the sprites in one image per palette, 'spr_atlas.json' holds the frame rectangles and hotspots */
+/* the frames are decoded unless 'decoded' already holds them at their findSprAtlas slot, with their hotspots set in 'frames' */
+/* the atlases are then packed in 'decoded' */
+static void saveSprAtlases(struct arena_t *arena, const uint8_t *spr, const uint8_t *tab, uint8_t *decoded, struct sprframe_t *frames) {
+	struct arenamark_t mark;
+	markArena(arena, &mark);
+	struct spratlas_t atlases[SPR_ATLAS_COUNT];
+	const bool predecoded = decoded != 0;
+	uint8_t *buffer = 0;
+	if (!predecoded) {
+		buffer = (uint8_t *)allocArena(arena, SPR_FRAME_SIZE);
+		decoded = (uint8_t *)allocArena(arena, kSprCount * kSprW * kSprH);
+	}
+	bool allocated = decoded != 0 && (predecoded || buffer != 0);
+	/* each atlas holds at most the frames of its range */
+	int persoCount = kSprCount;
+	for (int i = 0; kMonsters[i].name; ++i) {
+		persoCount -= kMonsters[i].end - kMonsters[i].start + 1;
+	}
+	int offset = 0;
+	for (int i = 0; i < SPR_ATLAS_COUNT; ++i) {
+		const int count = (i == 0) ? persoCount : kMonsters[i - 1].end - kMonsters[i - 1].start + 1;
+		atlases[i].name = (i == 0) ? "perso" : kMonsters[i - 1].name;
+		atlases[i].palette = (i == 0) ? kPalettePerso : kMonsters[i - 1].palette;
+		atlases[i].count = 0;
+		atlases[i].frames = decoded ? decoded + offset * kSprW * kSprH : 0;
+		atlases[i].hashes = (uint32_t *)allocArena(arena, count * sizeof(uint32_t));
+		allocated = allocated && atlases[i].hashes;
+		offset += count;
+	}
+	/* built in memory so it goes through writeOutputFile */
+	char *json = 0;
+	size_t jsonSize = 0;
+	FILE *fp = open_memstream(&json, &jsonSize);
+	if (allocated && fp) {
+		for (int i = 0; i < kSprCount; ++i) {
+			int slot;
+			const int a = findSprAtlas(i, &slot);
+			/* a unique frame is moved down to the next atlas slot, the following frames are not overwritten */
+			uint8_t *bitmap = decoded + slot * kSprW * kSprH;
+			if (!predecoded) {
+				bitmap = getAtlasSlot(&atlases[a]);
+				int dx, dy;
+				decodeSprFrame(spr, tab, i, buffer, bitmap, &dx, &dy);
+				frames[i].dx = dx;
+				frames[i].dy = dy;
+			}
+			frames[i].atlas = a;
+			frames[i].frame = addAtlasFrame(&atlases[a], bitmap);
+		}
+		fprintf(fp, "{\n\t\"atlases\": [\n");
+		for (int i = 0; i < SPR_ATLAS_COUNT; ++i) {
+			int w, h;
+			saveAtlas(arena, &atlases[i], &w, &h);
+			fprintf(fp, "\t\t{ \"name\": \"spr_%s.%s\", \"w\": %d, \"h\": %d, \"frames\": %d }%s\n", atlases[i].name, getImageExtension(), w, h, atlases[i].count, (i < SPR_ATLAS_COUNT - 1) ? "," : "");
+		}
+		fprintf(fp, "\t],\n\t\"frames\": [\n");
+		for (int i = 0; i < kSprCount; ++i) {
+			const int x = (frames[i].frame % SPR_ATLAS_COLUMNS) * kSprW;
+			const int y = (frames[i].frame / SPR_ATLAS_COLUMNS) * kSprH;
+			fprintf(fp, "\t\t{ \"atlas\": %d, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, \"dx\": %d, \"dy\": %d }%s\n", frames[i].atlas, x, y, kSprW, kSprH, frames[i].dx, frames[i].dy, (i < kSprCount - 1) ? "," : "");
+		}
+		fprintf(fp, "\t]\n}\n");
+	}
+	if (fp) {
+		fclose(fp);
+		if (allocated) {
+			writeOutputFile("spr_atlas.json", (const uint8_t *)json, jsonSize);
+		}
+	}
+	free(json);
+	releaseArena(arena, &mark);
+}
+
+void decodeSPRAtlasCtx(struct decoder_t *decoder, const char *name, const uint8_t *spr, const uint8_t *tab) {
+	assert(memcmp(spr, kSprHeader, sizeof(kSprHeader)) == 0);
+	countDecoderCall(kMetricsSPR);
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsSPR);
+	struct arenamark_t mark;
+	markArena(&decoder->arena, &mark);
+	struct sprframe_t *frames = (struct sprframe_t *)allocArena(&decoder->arena, kSprCount * sizeof(struct sprframe_t));
+	if (frames) {
+		saveSprAtlases(&decoder->arena, spr, tab, 0, frames);
+	}
+	releaseArena(&decoder->arena, &mark);
+	endMetricsScope(&scope);
+}
+
+void decodeSPC(const char *name, const uint8_t *spc, const uint8_t *mbk) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeSPCCtx(decoder, name, spc, mbk);
+		freeDecoder(decoder);
+	}
+}
+
+void decodeRP(const char *name, const uint8_t *rp, const uint8_t *spc, const uint8_t *mbk) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeRPCtx(decoder, name, rp, spc, mbk);
+		freeDecoder(decoder);
+	}
+}
+
+void decodeSPR(const char *name, const uint8_t *spr, const uint8_t *tab) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeSPRCtx(decoder, name, spr, tab);
+		freeDecoder(decoder);
+	}
+}
+
+void decodeSPRAtlas(const char *name, const uint8_t *spr, const uint8_t *tab) {
+	struct decoder_t *decoder = allocDecoder();
+	if (decoder) {
+		decodeSPRAtlasCtx(decoder, name, spr, tab);
+		freeDecoder(decoder);
+	}
+}
+
+struct spcbanktask_t {
+	const uint8_t *mbk;
+	int num;
+};
+
+struct spctask_t {
+	struct taskgroup_t group;
+	struct spcbanktask_t banks[];
+};
+
+static void runSpcBankTask(struct taskworker_t *worker, void *arg) {
+	const struct spcbanktask_t *bank = (const struct spcbanktask_t *)arg;
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsSPC);
+	decodeSpcBank(&worker->decoder->arena, bank->mbk, bank->num);
+	endMetricsScope(&scope);
+}
+
+static void finishSpcTask(struct taskworker_t *worker, void *arg) {
+	free(arg);
+}
+
+/* one task per bank */
+void spawnSPCTasks(struct taskworker_t *worker, const char *name, const uint8_t *spc, const uint8_t *mbk) {
+	countDecoderCall(kMetricsSPC);
+	checkSpcTable(spc);
+	struct spctask_t *task = (struct spctask_t *)malloc(sizeof(struct spctask_t) + kMbkCount * sizeof(struct spcbanktask_t));
+	if (!task) {
+		return;
+	}
+	openTaskGroup(&task->group, finishSpcTask, task);
+	for (int i = 0; i < kMbkCount; ++i) {
+		task->banks[i].mbk = mbk;
+		task->banks[i].num = i;
+		spawnTask(worker, &task->group, runSpcBankTask, &task->banks[i]);
+	}
+	closeTaskGroup(worker, &task->group);
+}
+
+#define SPR_TASK_FRAMES 64
+
+struct sprrangetask_t {
+	struct sprtask_t *task;
+	int start, end;
+};
+
+/* the atlases are packed once all the frames are decoded, in order */
+struct sprtask_t {
+	const uint8_t *spr, *tab;
+	uint8_t *decoded; /* kSprW x kSprH for each frame at its findSprAtlas slot, 0 if the frames are saved to files */
+	struct sprframe_t *frames;
+	struct taskgroup_t group;
+	struct sprrangetask_t ranges[];
+};
+
+static void runSprRangeTask(struct taskworker_t *worker, void *arg) {
+	const struct sprrangetask_t *range = (const struct sprrangetask_t *)arg;
+	const struct sprtask_t *task = range->task;
+	struct arena_t *arena = &worker->decoder->arena;
+	struct metricsscope_t scope;
+	beginMetricsScope(&scope, kMetricsSPR);
+	if (!task->decoded) {
+		saveSprFrames(arena, task->spr, task->tab, range->start, range->end);
+	} else {
+		struct arenamark_t mark;
+		markArena(arena, &mark);
+		uint8_t *buffer = (uint8_t *)allocArena(arena, SPR_FRAME_SIZE);
+		if (buffer) {
+			for (int i = range->start; i < range->end; ++i) {
+				int slot, dx, dy;
+				findSprAtlas(i, &slot);
+				decodeSprFrame(task->spr, task->tab, i, buffer, task->decoded + slot * kSprW * kSprH, &dx, &dy);
+				task->frames[i].dx = dx;
+				task->frames[i].dy = dy;
+			}
+		}
+		releaseArena(arena, &mark);
+	}
+	endMetricsScope(&scope);
+}
+
+static void finishSprTask(struct taskworker_t *worker, void *arg) {
+	struct sprtask_t *task = (struct sprtask_t *)arg;
+	if (task->decoded) {
+		struct metricsscope_t scope;
+		beginMetricsScope(&scope, kMetricsSPR);
+		saveSprAtlases(&worker->decoder->arena, task->spr, task->tab, task->decoded, task->frames);
+		endMetricsScope(&scope);
+		free(task->decoded);
+		free(task->frames);
+	}
+	free(task);
+}
+
+/* one task per SPR_TASK_FRAMES sprites */
+void spawnSPRTasks(struct taskworker_t *worker, const char *name, const uint8_t *spr, const uint8_t *tab, int flags) {
+	assert(memcmp(spr, kSprHeader, sizeof(kSprHeader)) == 0);
+	countDecoderCall(kMetricsSPR);
+	const int count = (kSprCount + SPR_TASK_FRAMES - 1) / SPR_TASK_FRAMES;
+	struct sprtask_t *task = (struct sprtask_t *)malloc(sizeof(struct sprtask_t) + count * sizeof(struct sprrangetask_t));
+	if (!task) {
+		return;
+	}
+	task->spr = spr;
+	task->tab = tab;
+	task->decoded = 0;
+	task->frames = 0;
+	if (flags & kDecodeSprAtlas) {
+		task->decoded = (uint8_t *)malloc(kSprCount * kSprW * kSprH);
+		task->frames = (struct sprframe_t *)malloc(kSprCount * sizeof(struct sprframe_t));
+		if (!task->decoded || !task->frames) {
+			free(task->decoded);
+			free(task->frames);
+			free(task);
+			return;
+		}
+	}
+	openTaskGroup(&task->group, finishSprTask, task);
+	for (int i = 0; i < count; ++i) {
+		task->ranges[i].task = task;
+		task->ranges[i].start = i * SPR_TASK_FRAMES;
+		task->ranges[i].end = (i == count - 1) ? kSprCount : (i + 1) * SPR_TASK_FRAMES;
+		spawnTask(worker, &task->group, runSprRangeTask, &task->ranges[i]);
 	}
+	closeTaskGroup(worker, &task->group);
 }
@@ -2,73 +2,559 @@
 import argparse
 import ctypes
 import hashlib
+import json
+import mmap
 import os
 import pathlib
 import sys
+import time
+import weakref
 import xml.etree.ElementTree as ET
 
 LIB = ctypes.cdll.LoadLibrary('./fb_decode.so')
+LIB.getOutputLogName.restype = ctypes.c_char_p
+LIB.getOutputLogHash.restype = ctypes.c_char_p
+
+MANIFEST = 'manifest.json'
+BATCH_MANIFEST = 'batch.json'
+
+class MbkStats(ctypes.Structure):
+	_fields_ = [ (name, ctypes.c_uint32) for name in ('hits', 'misses', 'evictions', 'bytes', 'peakBytes') ]
+
+class ImageStruct(ctypes.Structure):
+	_fields_ = [ ('name', ctypes.c_char * 64), ('w', ctypes.c_int), ('h', ctypes.c_int), ('colors', ctypes.c_int), ('palette', ctypes.c_uint8 * (256 * 3)), ('bits', ctypes.POINTER(ctypes.c_uint8)) ]
+
+LIB.popImage.restype = ctypes.POINTER(ImageStruct)
+LIB.freeImage.argtypes = [ ctypes.c_void_p ]
+
+class Image(object):
+	# 'pixels' (h rows of w palette indexes) and 'palette' (r, g, b triplets) are memoryviews of the library buffer, it is released with the last view
+	def __init__(self, ptr):
+		image = ptr.contents
+		self.name    = image.name.decode('ascii')
+		self.width   = image.w
+		self.height  = image.h
+		bits = (ctypes.c_uint8 * (image.w * image.h)).from_address(ctypes.addressof(image.bits.contents))
+		bits.image = image
+		weakref.finalize(image, LIB.freeImage, ctypes.addressof(image))
+		self.pixels  = memoryview(bits).cast('B', shape=[ image.h, image.w ])
+		self.palette = memoryview(image.palette).cast('B')[:image.colors * 3]
+
+def pop_images():
+	while True:
+		ptr = LIB.popImage()
+		if not ptr:
+			break
+		yield Image(ptr)
+
+LIB.allocDecoder.restype = ctypes.c_void_p
+LIB.freeDecoder.argtypes = [ ctypes.c_void_p ]
+LIB.renderLEVRoom.argtypes = [ ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p ]
+LIB.renderLEVRoom.restype = ctypes.c_bool
+
+class RoomRenderer(object):
+	# renders the rooms of a level one at a time, 'render' returns the pixels (224 rows of 256 palette indexes) and the 64 RGB colors palette
+	def __init__(self, name, lev, mbk, pal, sgd=None):
+		self.name = bytes(name, 'ascii')
+		self.lev, self.mbk, self.pal, self.sgd = lev, mbk, pal, sgd
+		self.decoder = LIB.allocDecoder()
+	def render(self, room):
+		pixels = bytearray(256 * 224)
+		palette = bytearray(64 * 3)
+		ptr = lambda b: ctypes.addressof((ctypes.c_char * len(b)).from_buffer(b))
+		if not LIB.renderLEVRoom(self.decoder, self.name, self.lev, self.mbk, self.pal, self.sgd, room, ptr(pixels), ptr(palette)):
+			return None
+		return memoryview(pixels).cast('B', shape=[ 224, 256 ]), palette
+	def __del__(self):
+		if self.decoder:
+			LIB.freeDecoder(self.decoder)
+			self.decoder = None
 
 class Asset(object):
 	def __init__(self, name, offset, size):
 		self.name   = name
-		self.offset = int(offset, 16)
-		self.size   = int(size)
+		self.offset = offset
+		self.size   = size
 	def read(self, rom):
 		return rom[self.offset:self.offset + self.size]
 	def dump(self, rom):
 		with open(self.name, 'wb') as f:
 			f.write(self.read(rom))
 
-def decode(rom, node, dumpfiles):
-	files = node.find('files').findall('file')
-	print('Found %d files' % len(files))
+def compressed_blobs(rom, assets):
+	# each blob is a (data, size) pair, the packed stream ends at 'size'
+	blobs = []
+	for filename, asset in assets.items():
+		name, ext = filename.split('.', 1)
+		data = asset.read(rom)
+		if ext == 'CT':
+			blobs.append((data, len(data)))
+		elif ext == 'LEV':
+			offsets = [ int.from_bytes(data[i * 4:i * 4 + 4], 'big') for i in range(64) ]
+			prev = 64 * 4
+			for offset in offsets:
+				if prev != 0 and offset != prev:
+					blobs.append((data, offset))
+				prev = offset
+		elif ext == 'MBK':
+			# the entries table has no count, stop at the first entry not pointing to a bank of 'count' tiles
+			i = 0
+			while (i + 1) * 6 <= len(data):
+				offset = int.from_bytes(data[i * 6:i * 6 + 4], 'big')
+				size = int.from_bytes(data[i * 6 + 4:i * 6 + 6], 'big')
+				if offset <= (i + 1) * 6 or offset > len(data):
+					break
+				if (size & 0x8000) == 0:
+					if offset < 16 or int.from_bytes(data[offset - 4:offset], 'big') != size * 32:
+						break
+					blobs.append((data, offset))
+				i += 1
+	return blobs
+
+def bench_unpack(rom, assets, iterations=20):
+	blobs = compressed_blobs(rom, assets)
+	buf = ctypes.create_string_buffer(0x10000)
+	unpacked = sum(int.from_bytes(data[size - 4:size], 'big') for data, size in blobs)
+	print('bytekiller_unpack: %d blobs, %d bytes unpacked' % (len(blobs), unpacked))
+	# the block copies of the references against the byte by byte copy of the original routine
+	timings = []
+	for byte_copy in (1, 0):
+		LIB.setUnpackByteCopy(byte_copy)
+		start = time.perf_counter()
+		for i in range(iterations):
+			for data, size in blobs:
+				LIB.bytekiller_unpack(buf, len(buf), data, size)
+		elapsed = time.perf_counter() - start
+		timings.append(elapsed)
+		print('%-10s %.3f ms per pass, %.1f MB/s' % ('byte copy' if byte_copy else 'block copy', elapsed * 1000 / iterations, unpacked * iterations / elapsed / 1000000))
+	LIB.setUnpackByteCopy(0)
+	print('speedup %.2fx' % (timings[0] / timings[1]))
+
+class Manifest(object):
+	# outputs of each decoder, keyed by the decoder version, the ROM SHA-1 and the name/offset/size of the assets read
+	# each output has its SHA-1, size and modification time, the files are only read back by the writers when rewritten
+	def __init__(self, rom_sha1, options):
+		self.rom_sha1 = rom_sha1
+		self.options  = options
+		self.steps    = {}
+		try:
+			with open(MANIFEST) as f:
+				manifest = json.load(f)
+			if manifest.get('version') == LIB.getDecoderVersion():
+				self.steps = manifest.get('steps', {})
+		except (OSError, ValueError):
+			pass
+		# the writers compare the new files with these hashes instead of reading the files back
+		LIB.clearRecordedOutputHashes()
+		for step in self.steps.values():
+			for filename, output in step['outputs'].items():
+				if isinstance(output, dict):
+					LIB.addRecordedOutputHash(bytes(filename, 'ascii'), bytes(output['sha1'], 'ascii'))
+	def key(self, inputs):
+		key = [ LIB.getDecoderVersion(), self.rom_sha1, self.options ] + [ (asset.name, asset.offset, asset.size) for asset in inputs ]
+		return hashlib.sha1(json.dumps(key).encode('ascii')).hexdigest()
+	def is_unchanged(self, name, inputs):
+		step = self.steps.get(name)
+		if not step or step['key'] != self.key(inputs):
+			return False
+		for filename, output in step['outputs'].items():
+			try:
+				st = os.stat(filename)
+			except OSError:
+				return False
+			if not isinstance(output, dict) or st.st_size != output.get('size') or st.st_mtime_ns != output.get('mtime_ns'):
+				return False
+		return True
+	def update(self, name, inputs):
+		outputs = {}
+		for i in range(LIB.getOutputLogCount()):
+			outputs[LIB.getOutputLogName(i).decode('ascii')] = { 'sha1': LIB.getOutputLogHash(i).decode('ascii') }
+		LIB.clearOutputLog()
+		self.steps[name] = { 'key': self.key(inputs), 'outputs': outputs }
+	def save(self):
+		# the size and time of the files written by this run, once the writers are done
+		LIB.flushOutputWriters()
+		for step in self.steps.values():
+			for filename, output in step['outputs'].items():
+				if 'mtime_ns' not in output:
+					try:
+						st = os.stat(filename)
+						output['size'] = st.st_size
+						output['mtime_ns'] = st.st_mtime_ns
+					except OSError:
+						pass
+		with open(MANIFEST + '.tmp', 'w') as f:
+			json.dump({ 'version': LIB.getDecoderVersion(), 'rom_sha1': self.rom_sha1, 'steps': self.steps }, f, indent=1, sort_keys=True)
+		os.replace(MANIFEST + '.tmp', MANIFEST)
+
+def read_assets(node):
 	assets = {}
-	for f in files:
+	for f in node.find('files').findall('file'):
 		name = f.get('name')
-		assets[name] = Asset(name, f.get('offset'), f.get('size'))
+		assets[name] = Asset(name, int(f.get('offset'), 16), int(f.get('size')))
+	return assets
+
+class RomFile(ctypes.Structure):
+	_fields_ = [ (name, ctypes.c_uint64) for name in ('size', 'timeNs', 'changeTimeNs', 'device', 'inode') ]
+	def __init__(self, st):
+		super().__init__(st.st_size, st.st_mtime_ns, st.st_ctime_ns, st.st_dev, st.st_ino)
+	def __eq__(self, other):
+		return bytes(self) == bytes(other)
+
+class RomIndexHeader(ctypes.Structure):
+	_fields_ = [ (name, ctypes.c_uint32) for name in ('tag', 'version') ] + [ ('romFile', RomFile), ('sha1', ctypes.c_char * 44) ] + [ (name, ctypes.c_uint32) for name in ('assetsOffset', 'assetsCount', 'entriesOffset', 'entriesCount') ]
+
+class RomIndexAsset(ctypes.Structure):
+	_fields_ = [ ('name', ctypes.c_char * 32) ] + [ (name, ctypes.c_uint32) for name in ('offset', 'size', 'type', 'first', 'count') ]
+
+class RomIndexEntry(ctypes.Structure):
+	_fields_ = [ ('offset', ctypes.c_uint32), ('size', ctypes.c_uint32), ('x', ctypes.c_int16), ('y', ctypes.c_int16), ('count', ctypes.c_uint16), ('flags', ctypes.c_uint8), ('num', ctypes.c_uint8) ]
+
+ROM_INDEX_TAG = 0x58494246
+ROM_INDEX_VERSION = 2
+
+# index written by LIB.writeRomIndex next to the ROM, see romindex.h for the entries of each asset type
+class RomIndex(object):
+	def __init__(self, path, rom_file):
+		with open(path, 'rb') as f:
+			self.data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+		header = RomIndexHeader.from_buffer_copy(self.data)
+		if header.tag != ROM_INDEX_TAG or header.version != ROM_INDEX_VERSION or header.romFile != rom_file:
+			raise ValueError('%s: out of date' % path)
+		assets_end = header.assetsOffset + header.assetsCount * ctypes.sizeof(RomIndexAsset)
+		entries_end = header.entriesOffset + header.entriesCount * ctypes.sizeof(RomIndexEntry)
+		if assets_end > len(self.data) or entries_end > len(self.data):
+			raise ValueError('%s: truncated' % path)
+		self.sha1 = header.sha1.decode('ascii')
+		self.assets = {}
+		for asset in (RomIndexAsset * header.assetsCount).from_buffer_copy(self.data, header.assetsOffset):
+			if asset.offset + asset.size > rom_file.size or asset.first + asset.count > header.entriesCount:
+				raise ValueError('%s: %s out of bounds' % (path, asset.name.decode('ascii')))
+			self.assets[asset.name.decode('ascii')] = asset
+		self.entries_offset = header.entriesOffset
+	def read_assets(self):
+		return { name: Asset(name, asset.offset, asset.size) for name, asset in self.assets.items() }
+	# LEV room, MBK bank, SGD shape, GLOBAL.SPR sprite or SPC entry 'num' of 'name', None if not present
+	def entry(self, name, num):
+		asset = self.assets.get(name)
+		if not asset or num < 0 or num >= asset.count:
+			return None
+		entry = RomIndexEntry.from_buffer_copy(self.data, self.entries_offset + (asset.first + num) * ctypes.sizeof(RomIndexEntry))
+		return entry if entry.offset != 0 else None
+
+LIB.writeRomIndex.argtypes = [ ctypes.c_char_p, ctypes.c_void_p, ctypes.POINTER(RomFile), ctypes.c_char_p, ctypes.c_void_p, ctypes.c_int ]
+LIB.writeRomIndex.restype = ctypes.c_bool
+
+def write_rom_index(path, rom, rom_file, sha1, assets):
+	buf = ctypes.create_string_buffer(rom, len(rom))
+	items = (DecodeAsset * len(assets))()
+	for i, asset in enumerate(assets.values()):
+		items[i].name = bytes(asset.name, 'ascii')
+		items[i].data = ctypes.addressof(buf) + asset.offset
+		items[i].size = asset.size
+	if not LIB.writeRomIndex(bytes(path, 'utf-8'), buf, ctypes.byref(rom_file), bytes(sha1, 'ascii'), items, len(assets)):
+		print('Unable to write \'%s\'' % path)
+
+# the index written for this ROM file saves hashing the ROM and parsing roms.xml, it is written otherwise
+def load_rom(path, index_path):
+	with open(path, 'rb') as f:
+		rom = f.read()
+		rom_file = RomFile(os.fstat(f.fileno()))
+	if index_path:
+		try:
+			index = RomIndex(index_path, rom_file)
+			return rom, index.sha1, index.read_assets()
+		except (OSError, ValueError):
+			pass
+	sha1 = hashlib.sha1(rom).hexdigest()
+	for node in ET.parse('roms.xml').getroot().findall('rom'):
+		if node.find('hash').get('sha1') == sha1:
+			assets = read_assets(node)
+			if index_path:
+				write_rom_index(index_path, rom, rom_file, sha1, assets)
+			return rom, sha1, assets
+	return rom, sha1, None
+
+# assets read by the decoder of 'filename', the asset itself first
+def decoder_inputs(assets, filename, asset):
+	name, ext = filename.split('.', 1)
+	if ext == 'LEV':
+		sgd = assets.get(name + '.SGD') if name == 'LEVEL1' else None
+		ct = assets.get(name + '.CT')
+		return [ asset, assets.get(name + '.MBK'), assets.get(name + '.PAL') ] + ([ sgd ] if sgd else []) + ([ ct ] if ct else [])
+	elif ext == 'RP':
+		return [ asset, assets.get('GLOBAL.SPC'), assets.get('SPC.MBK') ]
+	elif filename == 'GLOBAL.SPC':
+		return [ asset, assets.get('SPC.MBK') ]
+	elif filename == 'GLOBAL.SPR':
+		return [ asset, assets.get('GLOBAL.TAB') ]
+	return [ asset ]
+
+def run_decoder(rom, assets, filename, asset, read_mbk, threads, spr_atlas, level_map=False):
+	name, ext = filename.split('.', 1)
+	if ext == 'LEV':
+		lev = asset.read(rom)
+		mbk = read_mbk(name + '.MBK')
+		pal = assets.get(name + '.PAL').read(rom)
+		sgd = assets.get(name + '.SGD').read(rom) if name == 'LEVEL1' else None
+		ct = assets.get(name + '.CT')
+		# the map decoder also writes the rooms, each room is rendered once
+		if level_map and ct:
+			ct = ct.read(rom)
+			LIB.decodeLEVMap(bytes(asset.name, 'ascii'), lev, mbk, pal, sgd, ct, len(ct), threads)
+		else:
+			LIB.decodeLEVThreads(bytes(asset.name, 'ascii'), lev, mbk, pal, sgd, threads)
+	elif ext == 'RP':
+		rp  = asset.read(rom)
+		spc = assets.get('GLOBAL.SPC').read(rom)
+		mbk = read_mbk('SPC.MBK')
+		LIB.decodeRP(bytes(asset.name, 'ascii'), rp, spc, mbk)
+	elif filename == 'GLOBAL.SPC':
+		spc = asset.read(rom)
+		mbk = read_mbk('SPC.MBK')
+		LIB.decodeSPC(bytes(asset.name, 'ascii'), spc, mbk)
+	elif filename == 'GLOBAL.SPR':
+		spr = asset.read(rom)
+		tab = assets.get('GLOBAL.TAB').read(rom)
+		if spr_atlas:
+			LIB.decodeSPRAtlas(bytes(asset.name, 'ascii'), spr, tab)
+		else:
+			LIB.decodeSPR(bytes(asset.name, 'ascii'), spr, tab)
+	else:
+		dat = asset.read(rom)
+		LIB.decode(bytes(asset.name, 'ascii'), dat, len(dat))
+
+# the MBK bank cache is keyed by the blob address, pass the same object to each decoder
+def mbk_reader(rom, assets):
+	mbks = {}
+	def read_mbk(name):
+		if name not in mbks:
+			mbks[name] = assets.get(name).read(rom)
+		return mbks[name]
+	return read_mbk
+
+class WriterStats(ctypes.Structure):
+	_fields_ = [ (name, ctypes.c_uint32) for name in ('files', 'skipped', 'errors', 'bytes', 'peakQueued', 'peakQueuedBytes', 'stalls', 'stallMs', 'writeMs') ]
+
+def print_writer_stats():
+	stats = WriterStats()
+	LIB.getOutputWriterStats(ctypes.byref(stats))
+	print('Output: %d files written, %d unchanged, %d failed, %d bytes' % (stats.files, stats.skipped, stats.errors, stats.bytes))
+	print('Writers: %d files queued peak (%d bytes), %d stalls for %d ms, %d ms writing' % (stats.peakQueued, stats.peakQueuedBytes, stats.stalls, stats.stallMs, stats.writeMs))
+
+LIB.saveMetrics.argtypes = [ ctypes.c_char_p ]
+LIB.saveMetrics.restype = ctypes.c_bool
+
+def save_metrics(path):
+	if path and not LIB.saveMetrics(bytes(path, 'utf-8')):
+		print('Unable to write \'%s\'' % path)
+
+LIB.saveTrace.argtypes = [ ctypes.c_char_p ]
+LIB.saveTrace.restype = ctypes.c_bool
+
+def save_trace(path):
+	if path:
+		LIB.stopTrace()
+		if not LIB.saveTrace(bytes(path, 'utf-8')):
+			print('Unable to write \'%s\'' % path)
+
+def print_cache_stats():
+	stats = MbkStats()
+	LIB.getMbkCacheStats(ctypes.byref(stats))
+	print('MBK cache: %d hits, %d misses, %d evictions, %d bytes peak' % (stats.hits, stats.misses, stats.evictions, stats.peakBytes))
+	LIB.getSgdCachePeakSize.restype = ctypes.c_uint32
+	print('SGD cache: %d bytes peak' % LIB.getSgdCachePeakSize())
+
+class DecodeAsset(ctypes.Structure):
+	_fields_ = [ ('name', ctypes.c_char_p), ('data', ctypes.c_char_p), ('size', ctypes.c_uint32) ]
+
+class DecodeStats(ctypes.Structure):
+	_fields_ = [ (name, ctypes.c_uint32) for name in ('tasks', 'steals', 'arenaPeak') ]
+
+DECODE_SPR_ATLAS = 1 << 0
+DECODE_LEVEL_MAP = 1 << 1
+
+# all the decoders are run as tasks of the library scheduler, the LEV rooms, sprites and SPC banks being split further
+def decode_rom(rom, assets, threads, spr_atlas, level_map):
+	items = (DecodeAsset * len(assets))()
+	blobs = []
+	for i, asset in enumerate(assets.values()):
+		blobs.append((bytes(asset.name, 'ascii'), asset.read(rom)))
+		items[i].name, items[i].data = blobs[-1]
+		items[i].size = len(blobs[-1][1])
+	flags = (DECODE_SPR_ATLAS if spr_atlas else 0) | (DECODE_LEVEL_MAP if level_map else 0)
+	stats = DecodeStats()
+	LIB.decodeROM(items, len(assets), flags, threads, ctypes.byref(stats))
+	print('Tasks: %d run, %d stolen' % (stats.tasks, stats.steals))
+
+# 'on_image' is called with each decoded Image, the files are still written unless disabled with LIB.setImageOutput(0)
+# the decoders are run one at a time when the outputs are tracked per decoder, with 'manifest' or 'on_image'
+def decode(rom, assets, dumpfiles, threads=1, spr_atlas=False, manifest=None, on_image=None, level_map=False):
+	print('Found %d files' % len(assets))
+	if not manifest and not on_image:
+		if dumpfiles:
+			for asset in assets.values():
+				asset.dump(rom)
+		decode_rom(rom, assets, threads, spr_atlas, level_map)
+		print_cache_stats()
+		LIB.clearMbkCache()
+		return
+	read_mbk = mbk_reader(rom, assets)
+	skipped = 0
+	LIB.setImageCapture(1 if on_image else 0)
 	for filename, asset in assets.items():
 		if dumpfiles:
 			asset.dump(rom)
-		name, ext = filename.split('.', 1)
-		if ext == 'LEV':
-			lev = asset.read(rom)
-			mbk = assets.get(name + '.MBK').read(rom)
-			pal = assets.get(name + '.PAL').read(rom)
-			sgd = assets.get(name + '.SGD').read(rom) if name == 'LEVEL1' else None
-			LIB.decodeLEV(bytes(asset.name, 'ascii'), lev, mbk, pal, sgd)
-		elif ext == 'RP':
-			rp  = asset.read(rom)
-			spc = assets.get('GLOBAL.SPC').read(rom)
-			mbk = assets.get('SPC.MBK').read(rom)
-			LIB.decodeRP(bytes(asset.name, 'ascii'), rp, spc, mbk)
-		elif filename == 'GLOBAL.SPC':
-			spc = asset.read(rom)
-			mbk = assets.get('SPC.MBK').read(rom)
-			LIB.decodeSPC(bytes(asset.name, 'ascii'), spc, mbk)
-		elif filename == 'GLOBAL.SPR':
-			spr = asset.read(rom)
-			tab = assets.get('GLOBAL.TAB').read(rom)
-			LIB.decodeSPR(bytes(asset.name, 'ascii'), spr, tab)
-		else:
-			dat = asset.read(rom)
-			LIB.decode(bytes(asset.name, 'ascii'), dat, len(dat))
+		inputs = decoder_inputs(assets, filename, asset)
+		if manifest and manifest.is_unchanged(filename, inputs):
+			skipped += 1
+			continue
+		run_decoder(rom, assets, filename, asset, read_mbk, threads, spr_atlas, level_map)
+		if manifest:
+			manifest.update(filename, inputs)
+		if on_image:
+			for image in pop_images():
+				on_image(image)
+	if manifest:
+		manifest.save()
+		print('Incremental: %d of %d decoders skipped' % (skipped, len(assets)))
+	print_cache_stats()
+	LIB.clearMbkCache()
+
+# decodes each (asset name, input hashes) once for all the ROMs, the outputs are written to 'shared/<key>'
+# and each ROM directory links to the outputs of its decoders, BATCH_MANIFEST maps the ROM assets to the keys
+def decode_batch(roms, root, output_dir, dumpfiles, threads=1, spr_atlas=False, options=None, level_map=False):
+	output_dir = os.path.abspath(output_dir or '.')
+	shared_dir = os.path.join(output_dir, 'shared')
+	os.makedirs(shared_dir, exist_ok=True)
+	nodes = {}
+	for node in root.findall('rom'):
+		nodes[node.find('hash').get('sha1')] = node
+	manifest = { 'version': LIB.getDecoderVersion(), 'options': options, 'roms': {}, 'steps': {} }
+	decoded = 0
+	total = 0
+	for path in roms:
+		with open(path, 'rb') as f:
+			rom = f.read()
+		sha1 = hashlib.sha1(rom).hexdigest()
+		node = nodes.get(sha1)
+		if node is None:
+			print('%s: no matching ROM' % path)
+			continue
+		print('%s: %s' % (path, node.get('title')))
+		rom_dir = os.path.join(output_dir, sha1)
+		os.makedirs(rom_dir, exist_ok=True)
+		assets = read_assets(node)
+		read_mbk = mbk_reader(rom, assets)
+		hashes = {}
+		def asset_hash(asset):
+			if asset.name not in hashes:
+				hashes[asset.name] = hashlib.sha1(asset.read(rom)).hexdigest()
+			return hashes[asset.name]
+		entry = { 'path': path, 'title': node.get('title'), 'region': node.get('region'), 'assets': {} }
+		for filename, asset in assets.items():
+			if dumpfiles:
+				os.chdir(rom_dir)
+				asset.dump(rom)
+			inputs = decoder_inputs(assets, filename, asset)
+			key = [ LIB.getDecoderVersion(), options, filename ] + [ asset_hash(i) for i in inputs ]
+			key = hashlib.sha1(json.dumps(key).encode('ascii')).hexdigest()
+			step_dir = os.path.join(shared_dir, key)
+			outputs_path = os.path.join(step_dir, 'outputs.json')
+			total += 1
+			if key not in manifest['steps']:
+				try:
+					with open(outputs_path) as f:
+						outputs = json.load(f)
+				except (OSError, ValueError):
+					os.makedirs(step_dir, exist_ok=True)
+					os.chdir(step_dir)
+					run_decoder(rom, assets, filename, asset, read_mbk, threads, spr_atlas, level_map)
+					# the writers open the files relative to the current directory
+					LIB.flushOutputWriters()
+					outputs = sorted(name for name in os.listdir(step_dir) if name != 'outputs.json')
+					with open(outputs_path, 'w') as f:
+						json.dump(outputs, f)
+					decoded += 1
+				manifest['steps'][key] = outputs
+			for name in manifest['steps'][key]:
+				link = os.path.join(rom_dir, name)
+				if os.path.lexists(link):
+					os.remove(link)
+				os.symlink(os.path.relpath(os.path.join(step_dir, name), rom_dir), link)
+			entry['assets'][filename] = key
+		manifest['roms'][sha1] = entry
+		LIB.clearMbkCache()
+	os.chdir(output_dir)
+	with open(BATCH_MANIFEST, 'w') as f:
+		json.dump(manifest, f, indent=1, sort_keys=True)
+	print('Batch: %d of %d decoders run' % (decoded, total))
+	print_cache_stats()
 
 if __name__ == '__main__':
 	parser = argparse.ArgumentParser(description='Flashback genesis extraction tool')
 	parser.add_argument('--dump', action='store_true')
+	parser.add_argument('--bench', action='store_true', help='time bytekiller_unpack on every compressed blob')
 	parser.add_argument('--output_dir')
-	parser.add_argument('rom')
+	parser.add_argument('--png', action='store_true', help='write indexed PNG images instead of BMP')
+	parser.add_argument('--png_level', type=int, default=6, help='PNG compression level (0-9)')
+	parser.add_argument('--spr_atlas', action='store_true', help='pack the sprites in one image per palette')
+	parser.add_argument('--level_map', action='store_true', help='also lay out the rooms of each level on a tiled map, with lower resolution levels')
+	parser.add_argument('--threads', type=int, default=1, help='number of threads running the decoding tasks, 0 for one per core')
+	parser.add_argument('--mbk_cache_size', type=int, help='MBK bank cache size in bytes')
+	parser.add_argument('--writers', type=int, default=2, help='number of threads writing the files, 0 to write them from the decoding threads')
+	parser.add_argument('--fsync', action='store_true', help='flush the written files to disk before exiting')
+	parser.add_argument('--incremental', action='store_true', help='skip the decoders whose inputs did not change since the last run, see ' + MANIFEST)
+	parser.add_argument('--index', action='store_true', help='use a ROM index, written if missing or out of date')
+	parser.add_argument('--index_path', help='path of the ROM index, implies --index (default <rom>.fbidx)')
+	parser.add_argument('--metrics', help='write the decoding counters as JSON, relative to the output directory')
+	parser.add_argument('--trace', help='write a timeline of the decoding in the Chrome trace event format, relative to the output directory')
+	parser.add_argument('--batch', action='store_true', help='decode several ROMs, the assets identical across ROMs are only decoded once, see ' + BATCH_MANIFEST)
+	parser.add_argument('rom', nargs='+')
 	args = parser.parse_args()
-	with open(args.rom, 'rb') as f:
-		rom = f.read()
-		sha1 = hashlib.sha1(rom).hexdigest()
-		root = ET.parse('roms.xml').getroot()
-		for node in root.findall('rom'):
-			h = node.find('hash').get('sha1')
-			if h == sha1:
-				print('Found matching ROM')
-				if args.output_dir:
-					os.chdir(args.output_dir)
-				decode(rom, node, args.dump)
-				break
+	if len(args.rom) > 1 and not args.batch:
+		parser.error('several ROMs require --batch')
+	metrics_path = None
+	if args.metrics:
+		metrics_path = os.path.join(os.path.abspath(args.output_dir or '.'), args.metrics)
+		LIB.setMetricsEnabled(1)
+	trace_path = None
+	if args.trace:
+		trace_path = os.path.join(os.path.abspath(args.output_dir or '.'), args.trace)
+		LIB.startTrace()
+	if args.batch:
+		if args.png:
+			LIB.setImageFormat(1, args.png_level)
+		if args.mbk_cache_size is not None:
+			LIB.setMbkCacheSize(args.mbk_cache_size)
+		options = { 'png': args.png, 'png_level': args.png_level if args.png else None, 'spr_atlas': args.spr_atlas, 'level_map': args.level_map }
+		LIB.startOutputWriters(args.writers, 0, args.fsync)
+		decode_batch(args.rom, ET.parse('roms.xml').getroot(), args.output_dir, args.dump, args.threads, args.spr_atlas, options, args.level_map)
+		LIB.stopOutputWriters()
+		print_writer_stats()
+		save_metrics(metrics_path)
+		save_trace(trace_path)
+		sys.exit(0)
+	rom, sha1, assets = load_rom(args.rom[0], (args.index_path or args.rom[0] + '.fbidx') if args.index or args.index_path else None)
+	if assets is not None:
+		print('Found matching ROM')
+		if args.bench:
+			bench_unpack(rom, assets)
+			sys.exit(0)
+		if args.png:
+			LIB.setImageFormat(1, args.png_level)
+		if args.mbk_cache_size is not None:
+			LIB.setMbkCacheSize(args.mbk_cache_size)
+		if args.output_dir:
+			os.chdir(args.output_dir)
+		manifest = None
+		if args.incremental:
+			LIB.setIncrementalOutput(1)
+			options = { 'png': args.png, 'png_level': args.png_level if args.png else None, 'spr_atlas': args.spr_atlas, 'level_map': args.level_map }
+			manifest = Manifest(sha1, options)
+		LIB.startOutputWriters(args.writers, 0, args.fsync)
+		decode(rom, assets, args.dump, args.threads, args.spr_atlas, manifest, level_map=args.level_map)
+		LIB.stopOutputWriters()
+		print_writer_stats()
+		save_metrics(metrics_path)
+		save_trace(trace_path)
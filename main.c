@@ -0,0 +1,208 @@
+
+#include <getopt.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "decode.h"
+#include "mbk.h"
+#include "metrics.h"
+#include "rom.h"
+#include "trace.h"
+#include "writer.h"
+
+static void dumpAsset(const struct rom_t *rom, const struct asset_t *asset) {
+	FILE *fp = fopen(asset->name, "wb");
+	if (fp) {
+		fwrite(rom->data + asset->offset, asset->size, 1, fp);
+		fclose(fp);
+	}
+}
+
+struct options_t {
+	bool dump;
+	bool sprAtlas;
+	bool levelMap;
+	int threads;
+	int writers;
+	bool sync;
+};
+
+static void decodeAssets(const struct rom_t *rom, const struct options_t *options) {
+	fprintf(stdout, "Found %d files\n", rom->assetsCount);
+	struct decodeasset_t assets[MAX_ASSETS];
+	for (int i = 0; i < rom->assetsCount; ++i) {
+		const struct asset_t *asset = &rom->assets[i];
+		if (options->dump) {
+			dumpAsset(rom, asset);
+		}
+		assets[i].name = asset->name;
+		assets[i].data = rom->data + asset->offset;
+		assets[i].size = asset->size;
+	}
+	const int flags = (options->sprAtlas ? kDecodeSprAtlas : 0) | (options->levelMap ? kDecodeLevelMap : 0);
+	struct decodestats_t decodeStats;
+	startOutputWriters(options->writers, 0, options->sync);
+	decodeROM(assets, rom->assetsCount, flags, options->threads, &decodeStats);
+	stopOutputWriters();
+	struct writerstats_t writerStats;
+	getOutputWriterStats(&writerStats);
+	fprintf(stdout, "Output: %u files written, %u unchanged, %u failed, %u bytes\n", writerStats.files, writerStats.skipped, writerStats.errors, writerStats.bytes);
+	fprintf(stdout, "Writers: %u files queued peak (%u bytes), %u stalls for %u ms, %u ms writing\n", writerStats.peakQueued, writerStats.peakQueuedBytes, writerStats.stalls, writerStats.stallMs, writerStats.writeMs);
+	fprintf(stdout, "Tasks: %u run, %u stolen\n", decodeStats.tasks, decodeStats.steals);
+	fprintf(stdout, "Decoder arena: %u bytes peak\n", decodeStats.arenaPeak);
+	struct mbkstats_t stats;
+	getMbkCacheStats(&stats);
+	fprintf(stdout, "MBK cache: %d hits, %d misses, %d evictions, %d bytes peak\n", stats.hits, stats.misses, stats.evictions, stats.peakBytes);
+	fprintf(stdout, "SGD cache: %u bytes peak\n", getSgdCachePeakSize());
+	clearMbkCache();
+}
+
+static const char *USAGE =
+	"Usage: %s [OPTIONS]... ROM\n"
+	"  --dump                 Dump the assets data files\n"
+	"  --output_dir=PATH      Directory where the files are written\n"
+	"  --roms=PATH            ROM list (default 'roms.xml')\n"
+	"  --png                  Write indexed PNG images instead of BMP\n"
+	"  --png_level=NUM        PNG compression level (0-9)\n"
+	"  --spr_atlas            Pack the sprites in one image per palette\n"
+	"  --level_map            Lay out the rooms of each level on a tiled map\n"
+	"  --threads=NUM          Number of threads running the decoding tasks, 0 for one per core\n"
+	"  --mbk_cache_size=NUM   MBK bank cache size in bytes\n"
+	"  --writers=NUM          Number of threads writing the files, 0 to write them from the decoding threads\n"
+	"  --fsync                Flush the written files to disk before exiting\n"
+	"  --index                Use a ROM index, written if missing or out of date\n"
+	"  --index_path=PATH      Path of the ROM index, implies --index (default '<rom>.fbidx')\n"
+	"  --metrics=FILE         Write the decoding counters as JSON, relative to the output directory\n"
+	"  --trace=FILE           Write a timeline of the decoding in the Chrome trace event format, relative to the output directory\n";
+
+int main(int argc, char *argv[]) {
+	struct options_t options;
+	options.dump = false;
+	options.sprAtlas = false;
+	options.levelMap = false;
+	options.threads = 1;
+	options.writers = 2;
+	options.sync = false;
+	const char *outputDir = 0;
+	const char *romsPath = "roms.xml";
+	const char *indexPath = 0;
+	bool useIndex = false;
+	const char *metricsPath = 0;
+	const char *tracePath = 0;
+	int pngLevel = 6;
+	bool png = false;
+	while (1) {
+		static struct option lopts[] = {
+			{ "dump",           no_argument,       0, 'd' },
+			{ "output_dir",     required_argument, 0, 'o' },
+			{ "roms",           required_argument, 0, 'r' },
+			{ "png",            no_argument,       0, 'p' },
+			{ "png_level",      required_argument, 0, 'l' },
+			{ "spr_atlas",      no_argument,       0, 'a' },
+			{ "level_map",      no_argument,       0, 'L' },
+			{ "threads",        required_argument, 0, 't' },
+			{ "mbk_cache_size", required_argument, 0, 'm' },
+			{ "writers",        required_argument, 0, 'w' },
+			{ "fsync",          no_argument,       0, 's' },
+			{ "index",          no_argument,       0, 'i' },
+			{ "index_path",     required_argument, 0, 'I' },
+			{ "metrics",        required_argument, 0, 'M' },
+			{ "trace",          required_argument, 0, 'T' },
+			{ 0, 0, 0, 0 }
+		};
+		int index;
+		const int c = getopt_long(argc, argv, "", lopts, &index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'd':
+			options.dump = true;
+			break;
+		case 'o':
+			outputDir = optarg;
+			break;
+		case 'r':
+			romsPath = optarg;
+			break;
+		case 'p':
+			png = true;
+			break;
+		case 'l':
+			pngLevel = atoi(optarg);
+			break;
+		case 'a':
+			options.sprAtlas = true;
+			break;
+		case 'L':
+			options.levelMap = true;
+			break;
+		case 't':
+			options.threads = atoi(optarg);
+			break;
+		case 'm':
+			setMbkCacheSize(strtoul(optarg, 0, 0));
+			break;
+		case 'w':
+			options.writers = atoi(optarg);
+			break;
+		case 's':
+			options.sync = true;
+			break;
+		case 'i':
+			useIndex = true;
+			break;
+		case 'I':
+			indexPath = optarg;
+			useIndex = true;
+			break;
+		case 'M':
+			metricsPath = optarg;
+			setMetricsEnabled(1);
+			break;
+		case 'T':
+			tracePath = optarg;
+			break;
+		default:
+			fprintf(stdout, USAGE, argv[0]);
+			return -1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stdout, USAGE, argv[0]);
+		return -1;
+	}
+	char defaultIndexPath[512];
+	if (!indexPath) {
+		snprintf(defaultIndexPath, sizeof(defaultIndexPath), "%s.fbidx", argv[optind]);
+		indexPath = defaultIndexPath;
+	}
+	static struct rom_t rom;
+	if (!openRom(&rom, argv[optind], romsPath, useIndex ? indexPath : 0)) {
+		return -1;
+	}
+	fprintf(stdout, "Found matching ROM%s\n", rom.indexed ? " (indexed)" : "");
+	if (png) {
+		setImageFormat(kImagePNG, pngLevel);
+	}
+	int ret = -1;
+	if (outputDir && chdir(outputDir) != 0) {
+		fprintf(stderr, "Unable to change directory to '%s'\n", outputDir);
+	} else {
+		if (tracePath) {
+			startTrace();
+		}
+		decodeAssets(&rom, &options);
+		if (tracePath) {
+			stopTrace();
+			if (!saveTrace(tracePath)) {
+				fprintf(stderr, "Unable to write '%s'\n", tracePath);
+			}
+		}
+		if (metricsPath && !saveMetrics(metricsPath)) {
+			fprintf(stderr, "Unable to write '%s'\n", metricsPath);
+		}
+		ret = 0;
+	}
+	closeRom(&rom);
+	return ret;
+}
@@ -0,0 +1,206 @@
+
+#include <pthread.h>
+#include "mbk.h"
+#include "unpack.h"
+
+#define MBK_HASH_SIZE 256
+#define MBK_CACHE_SIZE (16 << 20)
+
+struct mbkentry_t {
+	struct mbkbank_t bank;
+	const uint8_t *mbk;
+	int num;
+	uint32_t size, crc; /* packed stream trailer, guards against a blob reusing a freed address */
+	uint32_t allocSize;
+	int refs;
+	bool cached;
+	struct mbkentry_t *next; /* hash chain */
+	struct mbkentry_t *prev_lru, *next_lru; /* most recently used first */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct mbkentry_t *hash[MBK_HASH_SIZE];
+	struct mbkentry_t *head, *tail;
+	uint32_t maxBytes;
+	struct mbkstats_t stats;
+} _cache = { PTHREAD_MUTEX_INITIALIZER, { 0 }, 0, 0, MBK_CACHE_SIZE, { 0 } };
+
+static int hashKey(const uint8_t *mbk, int num) {
+	const uintptr_t key = ((uintptr_t)mbk >> 4) * 31 + num;
+	return (key ^ (key >> 8) ^ (key >> 16)) & (MBK_HASH_SIZE - 1);
+}
+
+static void unlinkLru(struct mbkentry_t *e) {
+	if (e->prev_lru) {
+		e->prev_lru->next_lru = e->next_lru;
+	} else {
+		_cache.head = e->next_lru;
+	}
+	if (e->next_lru) {
+		e->next_lru->prev_lru = e->prev_lru;
+	} else {
+		_cache.tail = e->prev_lru;
+	}
+	e->prev_lru = e->next_lru = 0;
+}
+
+static void pushLru(struct mbkentry_t *e) {
+	e->prev_lru = 0;
+	e->next_lru = _cache.head;
+	if (_cache.head) {
+		_cache.head->prev_lru = e;
+	} else {
+		_cache.tail = e;
+	}
+	_cache.head = e;
+}
+
+static void removeEntry(struct mbkentry_t *e) {
+	struct mbkentry_t **p = &_cache.hash[hashKey(e->mbk, e->num)];
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+	unlinkLru(e);
+	_cache.stats.bytes -= e->allocSize;
+	free((uint8_t *)e->bank.data);
+	free(e);
+}
+
+/* drop the least recently used banks not currently locked */
+static void evictEntries(void) {
+	struct mbkentry_t *e = _cache.tail;
+	while (e && _cache.stats.bytes > _cache.maxBytes) {
+		struct mbkentry_t *prev = e->prev_lru;
+		if (e->refs == 0) {
+			removeEntry(e);
+			++_cache.stats.evictions;
+		}
+		e = prev;
+	}
+}
+
+static struct mbkentry_t *findEntry(const uint8_t *mbk, int num, uint32_t size, uint32_t crc) {
+	for (struct mbkentry_t *e = _cache.hash[hashKey(mbk, num)]; e; e = e->next) {
+		if (e->mbk == mbk && e->num == num && e->size == size && e->crc == crc) {
+			return e;
+		}
+	}
+	return 0;
+}
+
+const struct mbkbank_t *lockMbkBank(const uint8_t *mbk, int num) {
+	const uint32_t offset = READ_BE_UINT32(mbk + num * 6);
+	const int count = (int16_t)READ_BE_UINT16(mbk + num * 6 + 4);
+	if (count < 0) { /* not packed, point to the blob data */
+		struct mbkentry_t *e = (struct mbkentry_t *)calloc(1, sizeof(struct mbkentry_t));
+		if (e) {
+			e->bank.data = mbk + offset;
+			e->bank.size = -count * 32;
+			e->bank.count = -count;
+		}
+		return e ? &e->bank : 0;
+	}
+	const uint32_t size = READ_BE_UINT32(mbk + offset - 4);
+	const uint32_t crc = READ_BE_UINT32(mbk + offset - 8);
+	pthread_mutex_lock(&_cache.lock);
+	struct mbkentry_t *e = findEntry(mbk, num, size, crc);
+	if (e) {
+		++_cache.stats.hits;
+		++e->refs;
+		unlinkLru(e);
+		pushLru(e);
+		pthread_mutex_unlock(&_cache.lock);
+		return &e->bank;
+	}
+	++_cache.stats.misses;
+	pthread_mutex_unlock(&_cache.lock);
+
+	e = (struct mbkentry_t *)calloc(1, sizeof(struct mbkentry_t));
+	/* tile indexes in the LEV room data are 8 bits, make sure they stay within the buffer */
+	const uint32_t allocSize = (size < 256 * 32) ? 256 * 32 : size;
+	uint8_t *data = (uint8_t *)calloc(1, allocSize);
+	if (!e || !data) {
+		free(e);
+		free(data);
+		return 0;
+	}
+	const int ret = bytekiller_unpack(data, size, mbk, offset);
+	assert(ret == 0);
+	e->bank.data = data;
+	e->bank.size = size;
+	e->bank.count = count;
+	e->mbk = mbk;
+	e->num = num;
+	e->size = size;
+	e->crc = crc;
+	e->allocSize = allocSize;
+	e->refs = 1;
+	e->cached = true;
+
+	pthread_mutex_lock(&_cache.lock);
+	struct mbkentry_t *other = findEntry(mbk, num, size, crc);
+	if (other) { /* unpacked concurrently by another thread */
+		++other->refs;
+		unlinkLru(other);
+		pushLru(other);
+		pthread_mutex_unlock(&_cache.lock);
+		free(data);
+		free(e);
+		return &other->bank;
+	}
+	const int h = hashKey(mbk, num);
+	e->next = _cache.hash[h];
+	_cache.hash[h] = e;
+	pushLru(e);
+	_cache.stats.bytes += allocSize;
+	if (_cache.stats.peakBytes < _cache.stats.bytes) {
+		_cache.stats.peakBytes = _cache.stats.bytes;
+	}
+	evictEntries();
+	pthread_mutex_unlock(&_cache.lock);
+	return &e->bank;
+}
+
+void unlockMbkBank(const struct mbkbank_t *bank) {
+	struct mbkentry_t *e = (struct mbkentry_t *)bank;
+	if (!e) {
+		return;
+	}
+	if (!e->cached) {
+		free(e);
+		return;
+	}
+	pthread_mutex_lock(&_cache.lock);
+	assert(e->refs > 0);
+	--e->refs;
+	evictEntries();
+	pthread_mutex_unlock(&_cache.lock);
+}
+
+void setMbkCacheSize(uint32_t bytes) {
+	pthread_mutex_lock(&_cache.lock);
+	_cache.maxBytes = bytes;
+	evictEntries();
+	pthread_mutex_unlock(&_cache.lock);
+}
+
+void getMbkCacheStats(struct mbkstats_t *stats) {
+	pthread_mutex_lock(&_cache.lock);
+	*stats = _cache.stats;
+	pthread_mutex_unlock(&_cache.lock);
+}
+
+void clearMbkCache(void) {
+	pthread_mutex_lock(&_cache.lock);
+	struct mbkentry_t *e = _cache.tail;
+	while (e) {
+		struct mbkentry_t *prev = e->prev_lru;
+		if (e->refs == 0) {
+			removeEntry(e);
+		}
+		e = prev;
+	}
+	pthread_mutex_unlock(&_cache.lock);
+}
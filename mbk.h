@@ -0,0 +1,29 @@
+
+#ifndef MBK_H__
+#define MBK_H__
+
+#include "intern.h"
+
+struct mbkbank_t {
+	const uint8_t *data; /* 8x8 tiles, 32 bytes each */
+	int size;
+	int count;
+};
+
+struct mbkstats_t {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	uint32_t bytes; /* currently cached */
+	uint32_t peakBytes;
+};
+
+/* the returned bank is read-only and stays valid until unlockMbkBank */
+const struct mbkbank_t *lockMbkBank(const uint8_t *mbk, int num);
+void unlockMbkBank(const struct mbkbank_t *bank);
+
+void setMbkCacheSize(uint32_t bytes);
+void getMbkCacheStats(struct mbkstats_t *stats);
+void clearMbkCache(void);
+
+#endif /* MBK_H__ */
@@ -0,0 +1,169 @@
+
+#include <inttypes.h>
+#include <time.h>
+#include "bitmap.h"
+#include "metrics.h"
+
+static const char *kDecoderNames[kMetricsDecodersCount] = {
+	"CT", "FNT", "ICN", "OBJ", "PGE", "LEV", "RP", "SPC", "SPR"
+};
+
+static const char *kOpNames[kOpCount] = {
+	"literal3", "reference8", "reference9", "reference10", "reference12", "literal8"
+};
+
+static int _metricsEnabled;
+static struct metrics_t _metrics;
+
+/* decoder of the current scope of the thread, the unpacked and written bytes are added to it */
+static _Thread_local int _scopeDecoder = -1;
+
+static uint64_t getTimeUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void addCounter(uint64_t *counter, uint64_t value) {
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static void maxCounter(uint64_t *counter, uint64_t value) {
+	uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	while (current < value && !__atomic_compare_exchange_n(counter, &current, value, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+void setMetricsEnabled(int enabled) {
+	__atomic_store_n(&_metricsEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+bool isMetricsEnabled(void) {
+	return __atomic_load_n(&_metricsEnabled, __ATOMIC_RELAXED) != 0;
+}
+
+void getMetrics(struct metrics_t *metrics) {
+	const uint64_t *src = (const uint64_t *)&_metrics;
+	uint64_t *dst = (uint64_t *)metrics;
+	for (size_t i = 0; i < sizeof(struct metrics_t) / sizeof(uint64_t); ++i) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
+
+void resetMetrics(void) {
+	uint64_t *counters = (uint64_t *)&_metrics;
+	for (size_t i = 0; i < sizeof(struct metrics_t) / sizeof(uint64_t); ++i) {
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+bool saveMetrics(const char *filename) {
+	struct metrics_t m;
+	getMetrics(&m);
+	FILE *fp = fopen(filename, "w");
+	if (!fp) {
+		return false;
+	}
+	fprintf(fp, "{\n\t\"decoders\": {");
+	for (int i = 0; i < kMetricsDecodersCount; ++i) {
+		const struct decodermetrics_t *d = &m.decoders[i];
+		fprintf(fp, "%s\n\t\t\"%s\": { \"calls\": %" PRIu64 ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 ", \"elapsed_ms\": %.3f }",
+			(i == 0) ? "" : ",", kDecoderNames[i], d->calls, d->bytesIn, d->bytesOut, d->elapsedUs / 1000.);
+	}
+	fprintf(fp, "\n\t},\n");
+	fprintf(fp, "\t\"bytekiller\": { \"calls\": %" PRIu64 ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 ", \"ops\": {", m.unpackCalls, m.unpackBytesIn, m.unpackBytesOut);
+	for (int i = 0; i < kOpCount; ++i) {
+		fprintf(fp, "%s \"%s\": %" PRIu64, (i == 0) ? "" : ",", kOpNames[i], m.unpackOps[i]);
+	}
+	fprintf(fp, " } },\n");
+	fprintf(fp, "\t\"rle\": { \"calls\": %" PRIu64 ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 " },\n", m.rleCalls, m.rleBytesIn, m.rleBytesOut);
+	fprintf(fp, "\t\"sprites\": { \"frames\": %" PRIu64 ", \"runs\": %" PRIu64 ", \"run_bytes\": %" PRIu64 ", \"literal_bytes\": %" PRIu64 " },\n", m.sprFrames, m.sprRuns, m.sprRunBytes, m.sprLiteralBytes);
+	fprintf(fp, "\t\"images\": { \"bmp_files\": %" PRIu64 ", \"bmp_bytes\": %" PRIu64 ", \"png_files\": %" PRIu64 ", \"png_bytes\": %" PRIu64 " },\n", m.bmpFiles, m.bmpBytes, m.pngFiles, m.pngBytes);
+	fprintf(fp, "\t\"scratch_peak\": %" PRIu64 "\n}\n", m.scratchPeak);
+	return fclose(fp) == 0;
+}
+
+void countDecoderCall(int decoder) {
+	if (isMetricsEnabled()) {
+		addCounter(&_metrics.decoders[decoder].calls, 1);
+	}
+}
+
+void beginMetricsScope(struct metricsscope_t *scope, int decoder) {
+	scope->decoder = decoder;
+	scope->prev = _scopeDecoder;
+	scope->start = isMetricsEnabled() ? getTimeUs() : 0;
+	_scopeDecoder = decoder;
+}
+
+void endMetricsScope(struct metricsscope_t *scope) {
+	_scopeDecoder = scope->prev;
+	if (scope->start != 0 && isMetricsEnabled()) {
+		addCounter(&_metrics.decoders[scope->decoder].elapsedUs, getTimeUs() - scope->start);
+	}
+}
+
+static void countDecoderBytesIn(uint32_t bytes) {
+	if (_scopeDecoder >= 0) {
+		addCounter(&_metrics.decoders[_scopeDecoder].bytesIn, bytes);
+	}
+}
+
+void countUnpack(const uint32_t *ops, uint32_t bytesIn, uint32_t bytesOut) {
+	if (!isMetricsEnabled()) {
+		return;
+	}
+	addCounter(&_metrics.unpackCalls, 1);
+	addCounter(&_metrics.unpackBytesIn, bytesIn);
+	addCounter(&_metrics.unpackBytesOut, bytesOut);
+	for (int i = 0; i < kOpCount; ++i) {
+		addCounter(&_metrics.unpackOps[i], ops[i]);
+	}
+	countDecoderBytesIn(bytesIn);
+}
+
+void countRLE(uint32_t bytesIn, uint32_t bytesOut) {
+	if (!isMetricsEnabled()) {
+		return;
+	}
+	addCounter(&_metrics.rleCalls, 1);
+	addCounter(&_metrics.rleBytesIn, bytesIn);
+	addCounter(&_metrics.rleBytesOut, bytesOut);
+	countDecoderBytesIn(bytesIn);
+}
+
+void countSprFrame(uint32_t bytesIn, uint32_t runs, uint32_t runBytes, uint32_t literalBytes) {
+	if (!isMetricsEnabled()) {
+		return;
+	}
+	addCounter(&_metrics.sprFrames, 1);
+	addCounter(&_metrics.sprRuns, runs);
+	addCounter(&_metrics.sprRunBytes, runBytes);
+	addCounter(&_metrics.sprLiteralBytes, literalBytes);
+	countDecoderBytesIn(bytesIn);
+}
+
+void countOutputFile(uint32_t bytes) {
+	if (isMetricsEnabled() && _scopeDecoder >= 0) {
+		addCounter(&_metrics.decoders[_scopeDecoder].bytesOut, bytes);
+	}
+}
+
+void countImageFile(int format, uint32_t bytes) {
+	if (!isMetricsEnabled()) {
+		return;
+	}
+	if (format == kImagePNG) {
+		addCounter(&_metrics.pngFiles, 1);
+		addCounter(&_metrics.pngBytes, bytes);
+	} else {
+		addCounter(&_metrics.bmpFiles, 1);
+		addCounter(&_metrics.bmpBytes, bytes);
+	}
+}
+
+void countScratchPeak(uint32_t bytes) {
+	if (isMetricsEnabled()) {
+		maxCounter(&_metrics.scratchPeak, bytes);
+	}
+}
@@ -0,0 +1,66 @@
+
+#ifndef METRICS_H__
+#define METRICS_H__
+
+#include "intern.h"
+#include "unpack.h"
+
+/* counters of the decoding work, disabled by default, the counting then stops at a flag test */
+
+enum {
+	kMetricsCT,
+	kMetricsFNT,
+	kMetricsICN,
+	kMetricsOBJ,
+	kMetricsPGE,
+	kMetricsLEV,
+	kMetricsRP,
+	kMetricsSPC,
+	kMetricsSPR,
+	kMetricsDecodersCount
+};
+
+struct decodermetrics_t {
+	uint64_t calls;
+	uint64_t bytesIn; /* compressed bytes read by bytekiller_unpack, decodeRLE and the sprite frames decoder */
+	uint64_t bytesOut; /* files written */
+	uint64_t elapsedUs; /* summed over the threads */
+};
+
+struct metrics_t {
+	struct decodermetrics_t decoders[kMetricsDecodersCount];
+	uint64_t unpackCalls, unpackBytesIn, unpackBytesOut;
+	uint64_t unpackOps[kOpCount]; /* bytekiller opcodes, indexed by kOpLiteral3... */
+	uint64_t rleCalls, rleBytesIn, rleBytesOut;
+	uint64_t sprFrames, sprRuns, sprRunBytes, sprLiteralBytes;
+	uint64_t bmpFiles, bmpBytes;
+	uint64_t pngFiles, pngBytes;
+	uint64_t scratchPeak; /* largest decoder context */
+};
+
+struct metricsscope_t {
+	int decoder;
+	int prev;
+	uint64_t start;
+};
+
+void setMetricsEnabled(int enabled);
+bool isMetricsEnabled(void);
+void getMetrics(struct metrics_t *metrics);
+void resetMetrics(void);
+/* returns false if the file could not be written */
+bool saveMetrics(const char *filename);
+
+void countDecoderCall(int decoder);
+/* the time until endMetricsScope is added to 'decoder', with the bytes this thread reads and writes meanwhile, scopes do not enclose waits */
+void beginMetricsScope(struct metricsscope_t *scope, int decoder);
+void endMetricsScope(struct metricsscope_t *scope);
+
+void countUnpack(const uint32_t *ops, uint32_t bytesIn, uint32_t bytesOut);
+void countRLE(uint32_t bytesIn, uint32_t bytesOut);
+void countSprFrame(uint32_t bytesIn, uint32_t runs, uint32_t runBytes, uint32_t literalBytes);
+void countOutputFile(uint32_t bytes);
+void countImageFile(int format, uint32_t bytes);
+void countScratchPeak(uint32_t bytes);
+
+#endif /* METRICS_H__ */
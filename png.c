@@ -0,0 +1,193 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "bitmap.h"
+#include "metrics.h"
+#include "trace.h"
+
+static const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+static uint8_t *writeUint32BE(uint8_t *dst, uint32_t value) {
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+	return dst + 4;
+}
+
+/* 'dst' points to the chunk type, the length has been written before */
+static uint8_t *endChunk(uint8_t *dst, int size) {
+	const uint32_t crc = crc32(0, dst, 4 + size);
+	return writeUint32BE(dst + 4 + size, crc);
+}
+
+static int filterCost(const uint8_t *row, int len) {
+	int cost = 0;
+	for (int i = 0; i < len; ++i) {
+		const int8_t b = (int8_t)row[i];
+		cost += (b < 0) ? -b : b;
+	}
+	return cost;
+}
+
+static uint8_t paethPredictor(int a, int b, int c) {
+	const int p = a + b - c;
+	const int pa = abs(p - a);
+	const int pb = abs(p - b);
+	const int pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return (pb <= pc) ? b : c;
+}
+
+/* picks the filter with the smallest sum of absolute differences, 'bpp' is 1 for both 4 and 8 bits depth */
+static void filterRow(uint8_t *dst, const uint8_t *row, const uint8_t *prev, int len, int bpp, uint8_t *tmp) {
+	int bestCost;
+	dst[0] = 0;
+	memcpy(dst + 1, row, len);
+	bestCost = filterCost(dst + 1, len);
+	for (int filter = 1; filter <= 4; ++filter) {
+		if (!prev && (filter == 2 || filter == 4)) {
+			continue;
+		}
+		for (int i = 0; i < len; ++i) {
+			const int a = (i >= bpp) ? row[i - bpp] : 0;
+			const int b = prev ? prev[i] : 0;
+			const int c = (prev && i >= bpp) ? prev[i - bpp] : 0;
+			switch (filter) {
+			case 1:
+				tmp[i] = row[i] - a;
+				break;
+			case 2:
+				tmp[i] = row[i] - b;
+				break;
+			case 3:
+				tmp[i] = row[i] - ((a + b) >> 1);
+				break;
+			case 4:
+				tmp[i] = row[i] - paethPredictor(a, b, c);
+				break;
+			}
+		}
+		const int cost = filterCost(tmp, len);
+		if (cost < bestCost) {
+			bestCost = cost;
+			dst[0] = filter;
+			memcpy(dst + 1, tmp, len);
+		}
+	}
+}
+
+/* 'colorType' is 3 for indexed with a palette of 'colors' entries, 2 for rgb */
+static uint8_t *encodePNG(const uint8_t *bits, int w, int h, int depth, int colorType, const uint8_t *pal, int colors, int level, int *size) {
+	const int bpp = (colorType == 2) ? 3 : 1;
+	const int pitch = (depth == 4) ? (w + 1) / 2 : w * bpp;
+
+	uint8_t *rows = (uint8_t *)malloc(3 * pitch + (pitch + 1) * h);
+	if (!rows) {
+		return 0;
+	}
+	uint8_t *packed = rows;
+	uint8_t *prev = rows + pitch;
+	uint8_t *tmp = rows + 2 * pitch;
+	uint8_t *filtered = rows + 3 * pitch;
+	for (int y = 0; y < h; ++y) {
+		const uint8_t *src = bits + y * w * bpp;
+		if (depth == 4) {
+			for (int x = 0; x < w; x += 2) {
+				const uint8_t lo = (x + 1 < w) ? src[x + 1] : 0;
+				packed[x >> 1] = (src[x] << 4) | lo;
+			}
+		} else {
+			memcpy(packed, src, pitch);
+		}
+		filterRow(filtered + y * (pitch + 1), packed, (y == 0) ? 0 : prev, pitch, bpp, tmp);
+		uint8_t *swap = prev;
+		prev = packed;
+		packed = swap;
+	}
+
+	uLongf compressedSize = compressBound((pitch + 1) * h);
+	const int bufSize = sizeof(kSignature) + (12 + 13) + (12 + colors * 3) + (12 + compressedSize) + 12;
+	uint8_t *buf = (uint8_t *)malloc(bufSize);
+	if (buf) {
+		uint8_t *p = buf;
+		memcpy(p, kSignature, sizeof(kSignature));
+		p += sizeof(kSignature);
+
+		p = writeUint32BE(p, 13);
+		uint8_t *chunk = p;
+		memcpy(p, "IHDR", 4);
+		p = writeUint32BE(p + 4, w);
+		p = writeUint32BE(p, h);
+		p[0] = depth;
+		p[1] = colorType;
+		p[2] = 0; // compression
+		p[3] = 0; // filter
+		p[4] = 0; // interlace
+		p = endChunk(chunk, 13);
+
+		if (colorType == 3) {
+			p = writeUint32BE(p, colors * 3);
+			chunk = p;
+			memcpy(p, "PLTE", 4);
+			memcpy(p + 4, pal, colors * 3);
+			p = endChunk(chunk, colors * 3);
+		}
+
+		if (compress2(p + 8, &compressedSize, filtered, (pitch + 1) * h, level) != Z_OK) {
+			free(buf);
+			free(rows);
+			return 0;
+		}
+		p = writeUint32BE(p, compressedSize);
+		chunk = p;
+		memcpy(p, "IDAT", 4);
+		p = endChunk(chunk, compressedSize);
+
+		p = writeUint32BE(p, 0);
+		chunk = p;
+		memcpy(p, "IEND", 4);
+		p = endChunk(chunk, 0);
+
+		*size = p - buf;
+	}
+	free(rows);
+	return buf;
+}
+
+uint8_t *allocPNG(const uint8_t *bits, int w, int h, const uint8_t *pal, int colors, int level, int *size) {
+	/* the palette is sized to the highest index used, the entries missing from 'pal' are black */
+	int maxColor = 0;
+	for (int i = 0; i < w * h; ++i) {
+		if (bits[i] > maxColor) {
+			maxColor = bits[i];
+		}
+	}
+	uint8_t plte[256 * 3];
+	const int count = (colors < maxColor + 1) ? colors : maxColor + 1;
+	memcpy(plte, pal, count * 3);
+	memset(plte + count * 3, 0, (maxColor + 1 - count) * 3);
+	const int depth = (maxColor < 16) ? 4 : 8;
+	return encodePNG(bits, w, h, depth, 3, plte, maxColor + 1, level, size);
+}
+
+uint8_t *allocPNGRGB(const uint8_t *rgb, int w, int h, int level, int *size) {
+	return encodePNG(rgb, w, h, 8, 2, 0, 0, level, size);
+}
+
+void savePNG(const char *filename, const uint8_t *bits, int w, int h, const uint8_t *pal, int colors, int level) {
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "image", "savePNG");
+	int size;
+	uint8_t *buf = allocPNG(bits, w, h, pal, colors, level, &size);
+	if (buf) {
+		countImageFile(kImagePNG, size);
+		writeOutputBuffer(filename, buf, size);
+		addTraceArg(&scope, "bytes", size);
+	}
+	endTraceScope(&scope);
+}
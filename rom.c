@@ -0,0 +1,181 @@
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rom.h"
+#include "romindex.h"
+#include "sha1.h"
+
+static char *readFile(const char *path) {
+	char *buf = 0;
+	FILE *fp = fopen(path, "rb");
+	if (fp) {
+		fseek(fp, 0, SEEK_END);
+		const long size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		buf = (char *)malloc(size + 1);
+		if (buf) {
+			const size_t count = fread(buf, 1, size, fp);
+			buf[count] = 0;
+		}
+		fclose(fp);
+	}
+	return buf;
+}
+
+/* copies the value of 'attr' from the tag starting at 'tag' */
+static bool getAttribute(const char *tag, const char *attr, char *value, int size) {
+	const char *end = strchr(tag, '>');
+	char pattern[32];
+	snprintf(pattern, sizeof(pattern), " %s=\"", attr);
+	const char *p = strstr(tag, pattern);
+	if (!p || !end || p > end) {
+		return false;
+	}
+	p += strlen(pattern);
+	int len = 0;
+	while (p[len] && p[len] != '"' && len < size - 1) {
+		value[len] = p[len];
+		++len;
+	}
+	value[len] = 0;
+	return true;
+}
+
+/* looks up the rom sha1 in the rom list and fills the assets table */
+static bool loadAssets(struct rom_t *rom, const char *xml) {
+	for (const char *p = strstr(xml, "<rom "); p; p = strstr(p + 1, "<rom ")) {
+		const char *hash = strstr(p, "<hash ");
+		char sha1[48];
+		if (!hash || !getAttribute(hash, "sha1", sha1, sizeof(sha1)) || strcasecmp(sha1, rom->sha1) != 0) {
+			continue;
+		}
+		const char *end = strstr(p, "</rom>");
+		rom->assetsCount = 0;
+		for (const char *f = strstr(p, "<file "); f && (!end || f < end); f = strstr(f + 1, "<file ")) {
+			struct asset_t *asset = &rom->assets[rom->assetsCount];
+			char offset[16], size[16];
+			if (getAttribute(f, "name", asset->name, sizeof(asset->name)) && getAttribute(f, "offset", offset, sizeof(offset)) && getAttribute(f, "size", size, sizeof(size))) {
+				asset->offset = strtoul(offset, 0, 16);
+				asset->size = strtoul(size, 0, 10);
+				if ((size_t)asset->offset + asset->size > rom->size) {
+					fprintf(stderr, "Asset %s out of ROM bounds\n", asset->name);
+					continue;
+				}
+				if (++rom->assetsCount == MAX_ASSETS) {
+					break;
+				}
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+const struct asset_t *findAsset(const struct rom_t *rom, const char *name) {
+	for (int i = 0; i < rom->assetsCount; ++i) {
+		if (strcmp(rom->assets[i].name, name) == 0) {
+			return &rom->assets[i];
+		}
+	}
+	return 0;
+}
+
+const uint8_t *getAssetData(const struct rom_t *rom, const char *name) {
+	const struct asset_t *asset = findAsset(rom, name);
+	if (!asset) {
+		fprintf(stderr, "Asset %s not found\n", name);
+		return 0;
+	}
+	return rom->data + asset->offset;
+}
+
+static bool loadIndexAssets(struct rom_t *rom, const char *indexPath, const struct romfile_t *romFile) {
+	struct romindex_t index;
+	if (!openRomIndex(&index, indexPath, romFile) || index.header->assetsCount > MAX_ASSETS) {
+		return false;
+	}
+	snprintf(rom->sha1, sizeof(rom->sha1), "%.40s", index.header->sha1);
+	rom->assetsCount = index.header->assetsCount;
+	for (int i = 0; i < rom->assetsCount; ++i) {
+		struct asset_t *asset = &rom->assets[i];
+		snprintf(asset->name, sizeof(asset->name), "%s", index.assets[i].name);
+		asset->offset = index.assets[i].offset;
+		asset->size = index.assets[i].size;
+	}
+	closeRomIndex(&index);
+	return true;
+}
+
+static void saveIndex(const struct rom_t *rom, const char *indexPath, const struct romfile_t *romFile) {
+	struct decodeasset_t assets[MAX_ASSETS];
+	for (int i = 0; i < rom->assetsCount; ++i) {
+		assets[i].name = rom->assets[i].name;
+		assets[i].data = rom->data + rom->assets[i].offset;
+		assets[i].size = rom->assets[i].size;
+	}
+	if (!writeRomIndex(indexPath, rom->data, romFile, rom->sha1, assets, rom->assetsCount)) {
+		fprintf(stderr, "Unable to write '%s'\n", indexPath);
+	}
+}
+
+bool openRom(struct rom_t *rom, const char *path, const char *romsPath, const char *indexPath) {
+	memset(rom, 0, sizeof(struct rom_t));
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open '%s'\n", path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	rom->size = st.st_size;
+	void *data = mmap(0, rom->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Unable to map '%s'\n", path);
+		return false;
+	}
+	rom->data = (const uint8_t *)data;
+	struct romfile_t romFile;
+	memset(&romFile, 0, sizeof(romFile));
+	romFile.size = st.st_size;
+	romFile.timeNs = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	romFile.changeTimeNs = (uint64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+	romFile.device = st.st_dev;
+	romFile.inode = st.st_ino;
+	/* the index written for this ROM file saves hashing the ROM and reading the ROM list */
+	if (indexPath && loadIndexAssets(rom, indexPath, &romFile)) {
+		rom->indexed = true;
+		return true;
+	}
+	uint8_t digest[20];
+	sha1(rom->data, rom->size, digest);
+	for (int i = 0; i < 20; ++i) {
+		snprintf(rom->sha1 + i * 2, 3, "%02x", digest[i]);
+	}
+	bool ret = false;
+	char *xml = readFile(romsPath);
+	if (!xml) {
+		fprintf(stderr, "Unable to read '%s'\n", romsPath);
+	} else {
+		ret = loadAssets(rom, xml);
+		free(xml);
+	}
+	if (!ret) {
+		closeRom(rom);
+	} else if (indexPath) {
+		saveIndex(rom, indexPath, &romFile);
+	}
+	return ret;
+}
+
+void closeRom(struct rom_t *rom) {
+	if (rom->data) {
+		munmap((void *)rom->data, rom->size);
+		rom->data = 0;
+	}
+}
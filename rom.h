@@ -0,0 +1,31 @@
+
+#ifndef ROM_H__
+#define ROM_H__
+
+#include "intern.h"
+
+#define MAX_ASSETS 256
+
+struct asset_t {
+	char name[32];
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct rom_t {
+	const uint8_t *data;
+	size_t size;
+	char sha1[41];
+	bool indexed; /* assets read from the index */
+	int assetsCount;
+	struct asset_t assets[MAX_ASSETS];
+};
+
+/* maps the ROM file and loads its assets table from the index at 'indexPath' or the ROM list, the index is written if missing or out of date, 'indexPath' can be 0 */
+bool openRom(struct rom_t *rom, const char *path, const char *romsPath, const char *indexPath);
+void closeRom(struct rom_t *rom);
+
+const struct asset_t *findAsset(const struct rom_t *rom, const char *name);
+const uint8_t *getAssetData(const struct rom_t *rom, const char *name);
+
+#endif /* ROM_H__ */
@@ -0,0 +1,395 @@
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "romindex.h"
+#include "unpack.h"
+
+static const uint32_t kRomIndexTag = 0x58494246; /* 'FBIX' */
+
+static const int kLevRooms = 64;
+static const int kSprCount = 1287;
+static const int kSprHeaderSize = 12;
+
+struct indexbuilder_t {
+	const uint8_t *rom;
+	struct romindexentry_t *entries;
+	uint32_t count, capacity;
+	int invalid;
+};
+
+static struct romindexentry_t *addEntries(struct indexbuilder_t *b, int count) {
+	if (b->count + count > b->capacity) {
+		uint32_t capacity = b->capacity ? b->capacity * 2 : 1024;
+		while (capacity < b->count + count) {
+			capacity *= 2;
+		}
+		struct romindexentry_t *entries = (struct romindexentry_t *)realloc(b->entries, capacity * sizeof(struct romindexentry_t));
+		if (!entries) {
+			return 0;
+		}
+		b->entries = entries;
+		b->capacity = capacity;
+	}
+	struct romindexentry_t *e = b->entries + b->count;
+	memset(e, 0, count * sizeof(struct romindexentry_t));
+	b->count += count;
+	return e;
+}
+
+static const struct decodeasset_t *findAsset(const struct decodeasset_t *assets, int count, const char *name) {
+	for (int i = 0; i < count; ++i) {
+		if (strcmp(assets[i].name, name) == 0) {
+			return &assets[i];
+		}
+	}
+	return 0;
+}
+
+static int getAssetType(const char *name) {
+	const char *ext = strrchr(name, '.');
+	if (ext) {
+		if (strcmp(ext, ".LEV") == 0) {
+			return kIndexAssetLEV;
+		} else if (strcmp(ext, ".MBK") == 0) {
+			return kIndexAssetMBK;
+		} else if (strcmp(ext, ".SGD") == 0) {
+			return kIndexAssetSGD;
+		} else if (strcmp(ext, ".SPC") == 0) {
+			return kIndexAssetSPC;
+		} else if (strcmp(name, "GLOBAL.SPR") == 0) {
+			return kIndexAssetSPR;
+		}
+	}
+	return kIndexAssetData;
+}
+
+/* a room is present if its data ends after the previous one */
+static int indexLEV(struct indexbuilder_t *b, const struct decodeasset_t *asset) {
+	if (asset->size < kLevRooms * 4) {
+		return -1;
+	}
+	const uint8_t *lev = asset->data;
+	struct romindexentry_t *e = addEntries(b, kLevRooms);
+	if (!e) {
+		return -1;
+	}
+	uint32_t prev = kLevRooms * 4;
+	for (int i = 0; i < kLevRooms; ++i, ++e) {
+		const uint32_t end = READ_BE_UINT32(lev + i * 4);
+		if (prev != 0 && end != prev) {
+			if (end < prev || end > asset->size || end - prev < 8 || READ_BE_UINT32(lev + end - 4) > 0x10000) {
+				++b->invalid;
+			} else {
+				e->offset = lev - b->rom + end;
+				e->size = READ_BE_UINT32(lev + end - 4);
+				e->flags = kIndexPacked;
+			}
+		}
+		prev = end;
+	}
+	return kLevRooms;
+}
+
+/* the entries table has no count, it ends with the first entry not pointing to a bank of 'count' tiles */
+static int indexMBK(struct indexbuilder_t *b, const struct decodeasset_t *asset) {
+	const uint8_t *mbk = asset->data;
+	int count = 0;
+	while ((count + 1) * 6 <= asset->size) {
+		const uint32_t offset = READ_BE_UINT32(mbk + count * 6);
+		const int tiles = (int16_t)READ_BE_UINT16(mbk + count * 6 + 4);
+		if (offset <= (uint32_t)(count + 1) * 6 || offset > asset->size) {
+			break;
+		}
+		if (tiles >= 0) {
+			if (offset < 16 || READ_BE_UINT32(mbk + offset - 4) != (uint32_t)tiles * 32) {
+				break;
+			}
+		} else if (offset + -tiles * 32 > asset->size) {
+			break;
+		}
+		struct romindexentry_t *e = addEntries(b, 1);
+		if (!e) {
+			return -1;
+		}
+		e->offset = mbk - b->rom + offset;
+		e->count = (tiles < 0) ? -tiles : tiles;
+		e->size = e->count * 32;
+		e->flags = (tiles < 0) ? 0 : kIndexPacked;
+		++count;
+	}
+	return count;
+}
+
+/* the last offset is the end of the file, shapes with a negative offset are not compressed */
+static int indexSGD(struct indexbuilder_t *b, const struct decodeasset_t *asset) {
+	const uint8_t *sgd = asset->data;
+	if (asset->size < 4) {
+		return -1;
+	}
+	const int count = (READ_BE_UINT32(sgd) / 4) - 1;
+	if (count < 0 || (uint32_t)count * 4 > asset->size) {
+		return -1;
+	}
+	struct romindexentry_t *e = addEntries(b, count);
+	if (!e) {
+		return -1;
+	}
+	for (int i = 0; i < count; ++i, ++e) {
+		const int offset = READ_BE_UINT32(sgd + i * 4);
+		if (offset < 0) {
+			if ((uint32_t)-offset + 2 > asset->size || (uint32_t)-offset + 2 + READ_BE_UINT16(sgd - offset) > asset->size) {
+				++b->invalid;
+				continue;
+			}
+			e->offset = sgd - b->rom + -offset + 2;
+			e->size = READ_BE_UINT16(sgd - offset);
+		} else {
+			if ((uint32_t)offset + 2 > asset->size || (uint32_t)offset + 2 + (READ_BE_UINT16(sgd + offset) & 0x7FFF) > asset->size) {
+				++b->invalid;
+				continue;
+			}
+			e->offset = sgd - b->rom + offset;
+			e->size = getRLESize(sgd + offset);
+			e->flags = kIndexRLE;
+		}
+	}
+	return count;
+}
+
+static int indexSPR(struct indexbuilder_t *b, const struct decodeasset_t *asset, const struct decodeasset_t *tab) {
+	if (!tab || tab->size < kSprCount * 4) {
+		return -1;
+	}
+	const uint8_t *spr = asset->data;
+	struct romindexentry_t *e = addEntries(b, kSprCount);
+	if (!e) {
+		return -1;
+	}
+	for (int i = 0; i < kSprCount; ++i, ++e) {
+		const uint32_t offset = READ_BE_UINT32(tab->data + i * 4) + kSprHeaderSize;
+		if (offset + 4 > asset->size || offset + 4 + READ_BE_UINT16(spr + offset + 2) + 1 > asset->size) {
+			++b->invalid;
+			continue;
+		}
+		const uint8_t *p = spr + offset;
+		e->offset = p + 4 - b->rom;
+		e->size = READ_BE_UINT16(p + 2) + 1;
+		e->x = (int8_t)p[0];
+		e->y = (int8_t)p[1];
+		e->flags = kIndexRLE;
+	}
+	return kSprCount;
+}
+
+/* each offset is the one of the previous entry or the next one */
+static int indexSPC(struct indexbuilder_t *b, const struct decodeasset_t *asset) {
+	const uint8_t *spc = asset->data;
+	if (asset->size < 2) {
+		return -1;
+	}
+	const int count = READ_BE_UINT16(spc) / 2;
+	if ((uint32_t)count * 2 > asset->size) {
+		return -1;
+	}
+	struct romindexentry_t *e = addEntries(b, count);
+	if (!e) {
+		return -1;
+	}
+	uint32_t prev = READ_BE_UINT16(spc);
+	uint32_t next = 0;
+	for (int i = 0; i < count; ++i, ++e) {
+		const uint32_t offset = READ_BE_UINT16(spc + i * 2);
+		if ((offset != prev && offset != next) || offset + 6 > asset->size || offset + 6 + spc[offset + 5] * 4 > asset->size || spc[offset] >= 0x4A) {
+			++b->invalid;
+			continue;
+		}
+		const uint8_t *p = spc + offset;
+		e->offset = p - b->rom;
+		e->size = 6 + p[5] * 4;
+		e->x = (int8_t)p[1];
+		e->y = (int8_t)p[2];
+		e->count = p[5];
+		e->num = p[0];
+		prev = offset;
+		next = offset + e->size;
+	}
+	return count;
+}
+
+static int compareAssets(const void *a, const void *b) {
+	return strcmp(((const struct romindexasset_t *)a)->name, ((const struct romindexasset_t *)b)->name);
+}
+
+static bool writeIndexFile(const char *path, const struct romindexheader_t *header, const struct romindexasset_t *assets, const struct romindexentry_t *entries) {
+	/* written to a temporary file first, the index being mapped by other processes */
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *fp = fopen(tmp, "wb");
+	if (!fp) {
+		return false;
+	}
+	bool ret = fwrite(header, sizeof(struct romindexheader_t), 1, fp) == 1;
+	ret = ret && fwrite(assets, sizeof(struct romindexasset_t), header->assetsCount, fp) == header->assetsCount;
+	ret = ret && fwrite(entries, sizeof(struct romindexentry_t), header->entriesCount, fp) == header->entriesCount;
+	ret = (fclose(fp) == 0) && ret;
+	if (!ret || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+bool writeRomIndex(const char *path, const uint8_t *rom, const struct romfile_t *romFile, const char *sha1, const struct decodeasset_t *assets, int count) {
+	struct romindexasset_t *indexAssets = (struct romindexasset_t *)calloc(count ? count : 1, sizeof(struct romindexasset_t));
+	if (!indexAssets) {
+		return false;
+	}
+	struct indexbuilder_t b;
+	memset(&b, 0, sizeof(b));
+	b.rom = rom;
+	bool ret = true;
+	for (int i = 0; i < count && ret; ++i) {
+		const struct decodeasset_t *asset = &assets[i];
+		struct romindexasset_t *a = &indexAssets[i];
+		if (asset->data < rom || asset->data + asset->size > rom + romFile->size) {
+			fprintf(stderr, "Asset %s out of ROM bounds\n", asset->name);
+			ret = false;
+			break;
+		}
+		snprintf(a->name, sizeof(a->name), "%s", asset->name);
+		a->offset = asset->data - rom;
+		a->size = asset->size;
+		a->type = getAssetType(asset->name);
+		a->first = b.count;
+		const int invalid = b.invalid;
+		int entries = 0;
+		switch (a->type) {
+		case kIndexAssetLEV:
+			entries = indexLEV(&b, asset);
+			break;
+		case kIndexAssetMBK:
+			entries = indexMBK(&b, asset);
+			break;
+		case kIndexAssetSGD:
+			entries = indexSGD(&b, asset);
+			break;
+		case kIndexAssetSPR:
+			entries = indexSPR(&b, asset, findAsset(assets, count, "GLOBAL.TAB"));
+			break;
+		case kIndexAssetSPC:
+			entries = indexSPC(&b, asset);
+			break;
+		}
+		if (entries < 0) {
+			fprintf(stderr, "Invalid table in %s\n", asset->name);
+			a->type = kIndexAssetData;
+			entries = 0;
+			b.count = a->first;
+		} else if (b.invalid != invalid) {
+			fprintf(stderr, "%d invalid entries in %s\n", b.invalid - invalid, asset->name);
+		}
+		a->count = entries;
+	}
+	if (ret) {
+		qsort(indexAssets, count, sizeof(struct romindexasset_t), compareAssets);
+		struct romindexheader_t header;
+		memset(&header, 0, sizeof(header));
+		header.tag = kRomIndexTag;
+		header.version = ROM_INDEX_VERSION;
+		header.romFile = *romFile;
+		snprintf(header.sha1, sizeof(header.sha1), "%s", sha1);
+		header.assetsOffset = sizeof(struct romindexheader_t);
+		header.assetsCount = count;
+		header.entriesOffset = header.assetsOffset + count * sizeof(struct romindexasset_t);
+		header.entriesCount = b.count;
+		ret = writeIndexFile(path, &header, indexAssets, b.entries);
+	}
+	free(b.entries);
+	free(indexAssets);
+	return ret;
+}
+
+static bool checkRomIndex(const struct romindex_t *index, const struct romfile_t *romFile) {
+	const struct romindexheader_t *header = index->header;
+	if (index->size < sizeof(struct romindexheader_t) || header->tag != kRomIndexTag || header->version != ROM_INDEX_VERSION) {
+		return false;
+	}
+	if (memcmp(&header->romFile, romFile, sizeof(struct romfile_t)) != 0 || memchr(header->sha1, 0, sizeof(header->sha1)) == 0) {
+		return false;
+	}
+	const uint64_t assetsEnd = header->assetsOffset + (uint64_t)header->assetsCount * sizeof(struct romindexasset_t);
+	const uint64_t entriesEnd = header->entriesOffset + (uint64_t)header->entriesCount * sizeof(struct romindexentry_t);
+	if (assetsEnd > index->size || entriesEnd > index->size || (header->assetsOffset & 3) != 0 || (header->entriesOffset & 3) != 0) {
+		return false;
+	}
+	const struct romindexasset_t *assets = (const struct romindexasset_t *)(index->data + header->assetsOffset);
+	for (uint32_t i = 0; i < header->assetsCount; ++i) {
+		const struct romindexasset_t *a = &assets[i];
+		if (memchr(a->name, 0, sizeof(a->name)) == 0 || (uint64_t)a->offset + a->size > romFile->size || (uint64_t)a->first + a->count > header->entriesCount) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool openRomIndex(struct romindex_t *index, const char *path, const struct romfile_t *romFile) {
+	memset(index, 0, sizeof(struct romindex_t));
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct romindexheader_t)) {
+		close(fd);
+		return false;
+	}
+	void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	index->data = (const uint8_t *)data;
+	index->size = st.st_size;
+	index->header = (const struct romindexheader_t *)index->data;
+	if (!checkRomIndex(index, romFile)) {
+		closeRomIndex(index);
+		return false;
+	}
+	index->assets = (const struct romindexasset_t *)(index->data + index->header->assetsOffset);
+	index->entries = (const struct romindexentry_t *)(index->data + index->header->entriesOffset);
+	return true;
+}
+
+void closeRomIndex(struct romindex_t *index) {
+	if (index->data) {
+		munmap((void *)index->data, index->size);
+	}
+	memset(index, 0, sizeof(struct romindex_t));
+}
+
+const struct romindexasset_t *findIndexAsset(const struct romindex_t *index, const char *name) {
+	int lo = 0;
+	int hi = index->header->assetsCount - 1;
+	while (lo <= hi) {
+		const int mid = (lo + hi) / 2;
+		const int cmp = strcmp(index->assets[mid].name, name);
+		if (cmp == 0) {
+			return &index->assets[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return 0;
+}
+
+const struct romindexentry_t *getIndexEntry(const struct romindex_t *index, const struct romindexasset_t *asset, int num) {
+	if (num < 0 || (uint32_t)num >= asset->count) {
+		return 0;
+	}
+	const struct romindexentry_t *e = &index->entries[asset->first + num];
+	return e->offset ? e : 0;
+}
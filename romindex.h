@@ -0,0 +1,81 @@
+
+#ifndef ROMINDEX_H__
+#define ROMINDEX_H__
+
+#include "decode.h"
+
+/* the index file is the header followed by the assets, sorted by name, and their entries, all in the host byte order */
+
+#define ROM_INDEX_VERSION 2
+
+enum {
+	kIndexAssetData, /* no entries */
+	kIndexAssetLEV, /* 64 rooms */
+	kIndexAssetMBK, /* banks */
+	kIndexAssetSGD, /* shapes */
+	kIndexAssetSPR, /* 1287 sprites, from GLOBAL.TAB */
+	kIndexAssetSPC /* SPC table entries */
+};
+
+enum {
+	kIndexPacked = 1 << 0, /* bytekiller stream, read backwards from 'offset' */
+	kIndexRLE = 1 << 1
+};
+
+/* identifies the ROM file the index was written for, a file patched or copied over changes its change time */
+struct romfile_t {
+	uint64_t size;
+	uint64_t timeNs; /* modification time */
+	uint64_t changeTimeNs;
+	uint64_t device, inode;
+};
+
+struct romindexheader_t {
+	uint32_t tag; /* 'FBIX', does not match if read with the other byte order */
+	uint32_t version;
+	struct romfile_t romFile;
+	char sha1[44];
+	uint32_t assetsOffset, assetsCount;
+	uint32_t entriesOffset, entriesCount;
+};
+
+struct romindexasset_t {
+	char name[32];
+	uint32_t offset, size; /* in the ROM */
+	uint32_t type;
+	uint32_t first, count; /* entries */
+};
+
+/* LEV: 'offset' is the end of the packed room, 'size' the unpacked size
+   MBK: 'size' is 'count' 8x8 tiles of 32 bytes
+   SGD: 'size' is the decoded shape size
+   SPR: 'offset' points to the RLE bytes following the frame header, 'size' is their count, 'x' and 'y' the frame position
+   SPC: 'size' is the size of the entry, 'x' and 'y' the position of the 'count' parts, 'num' the RP number */
+struct romindexentry_t {
+	uint32_t offset; /* in the ROM, 0 if not present */
+	uint32_t size;
+	int16_t x, y;
+	uint16_t count;
+	uint8_t flags;
+	uint8_t num;
+};
+
+struct romindex_t {
+	const uint8_t *data; /* mapped file */
+	uint32_t size;
+	const struct romindexheader_t *header;
+	const struct romindexasset_t *assets;
+	const struct romindexentry_t *entries;
+};
+
+/* validates the tables of 'assets', their data pointing into 'rom', and writes the index to 'path', the invalid entries are left out */
+bool writeRomIndex(const char *path, const uint8_t *rom, const struct romfile_t *romFile, const char *sha1, const struct decodeasset_t *assets, int count);
+/* maps the index, fails if it was not written for this ROM file */
+bool openRomIndex(struct romindex_t *index, const char *path, const struct romfile_t *romFile);
+void closeRomIndex(struct romindex_t *index);
+
+const struct romindexasset_t *findIndexAsset(const struct romindex_t *index, const char *name);
+/* returns 0 if 'num' is out of range or the entry not present */
+const struct romindexentry_t *getIndexEntry(const struct romindex_t *index, const struct romindexasset_t *asset, int num);
+
+#endif /* ROMINDEX_H__ */
@@ -0,0 +1,73 @@
+
+#include "sha1.h"
+
+static uint32_t rol32(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+static void sha1Block(uint32_t *h, const uint8_t *block) {
+	uint32_t w[80];
+	for (int i = 0; i < 16; ++i) {
+		w[i] = READ_BE_UINT32(block + i * 4);
+	}
+	for (int i = 16; i < 80; ++i) {
+		w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (int i = 0; i < 80; ++i) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		const uint32_t t = rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void sha1(const uint8_t *data, size_t size, uint8_t digest[20]) {
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	size_t offset = 0;
+	for (; offset + 64 <= size; offset += 64) {
+		sha1Block(h, data + offset);
+	}
+	/* padding, followed by the message length in bits */
+	uint8_t block[128];
+	const size_t remaining = size - offset;
+	memcpy(block, data + offset, remaining);
+	block[remaining] = 0x80;
+	const size_t blockSize = (remaining < 56) ? 64 : 128;
+	memset(block + remaining + 1, 0, blockSize - remaining - 1);
+	const uint64_t bits = (uint64_t)size * 8;
+	for (int i = 0; i < 8; ++i) {
+		block[blockSize - 1 - i] = (uint8_t)(bits >> (i * 8));
+	}
+	sha1Block(h, block);
+	if (blockSize == 128) {
+		sha1Block(h, block + 64);
+	}
+	for (int i = 0; i < 5; ++i) {
+		digest[i * 4]     = h[i] >> 24;
+		digest[i * 4 + 1] = h[i] >> 16;
+		digest[i * 4 + 2] = h[i] >> 8;
+		digest[i * 4 + 3] = h[i];
+	}
+}
@@ -0,0 +1,9 @@
+
+#ifndef SHA1_H__
+#define SHA1_H__
+
+#include "intern.h"
+
+void sha1(const uint8_t *data, size_t size, uint8_t digest[20]);
+
+#endif /* SHA1_H__ */
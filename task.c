@@ -0,0 +1,229 @@
+
+#include <unistd.h>
+#include "task.h"
+#include "trace.h"
+
+#define MAX_TASK_THREADS 64
+
+struct scheduler_t {
+	int count;
+	struct taskworker_t *workers;
+	int pending; /* tasks spawned and not completed */
+	int queued; /* tasks waiting in the queues */
+	int sleeping;
+	pthread_mutex_t idleLock;
+	pthread_cond_t idleCond;
+};
+
+static bool pushTask(struct taskqueue_t *q, const struct task_t *task) {
+	bool ret = true;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail - q->head == q->capacity) {
+		const uint32_t capacity = (q->capacity == 0) ? 64 : q->capacity * 2;
+		struct task_t *tasks = (struct task_t *)malloc(capacity * sizeof(struct task_t));
+		if (tasks) {
+			for (uint32_t i = q->head; i != q->tail; ++i) {
+				tasks[i - q->head] = q->tasks[i % q->capacity];
+			}
+			free(q->tasks);
+			q->tasks = tasks;
+			q->tail -= q->head;
+			q->head = 0;
+			q->capacity = capacity;
+		} else {
+			ret = false;
+		}
+	}
+	if (ret) {
+		q->tasks[q->tail % q->capacity] = *task;
+		++q->tail;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+/* the owner takes the newest task */
+static bool popTask(struct taskqueue_t *q, struct task_t *task) {
+	bool ret = false;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail != q->head) {
+		--q->tail;
+		*task = q->tasks[q->tail % q->capacity];
+		ret = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+/* the other workers take the oldest one, likely to spawn more tasks */
+static bool stealTask(struct taskqueue_t *q, struct task_t *task) {
+	bool ret = false;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail != q->head) {
+		*task = q->tasks[q->head % q->capacity];
+		++q->head;
+		ret = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static void wakeWorkers(struct scheduler_t *s) {
+	pthread_mutex_lock(&s->idleLock);
+	pthread_cond_broadcast(&s->idleCond);
+	pthread_mutex_unlock(&s->idleLock);
+}
+
+static void completeGroup(struct taskworker_t *worker, struct taskgroup_t *group) {
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0 && group->done) {
+		/* the group may be freed by 'done' */
+		group->done(worker, group->arg);
+	}
+}
+
+static void runTask(struct taskworker_t *worker, const struct task_t *task) {
+	struct scheduler_t *s = worker->scheduler;
+	task->proc(worker, task->arg);
+	++worker->tasks;
+	if (task->group) {
+		completeGroup(worker, task->group);
+	}
+	if (__atomic_sub_fetch(&s->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		wakeWorkers(s);
+	}
+}
+
+void spawnTask(struct taskworker_t *worker, struct taskgroup_t *group, taskproc_t proc, void *arg) {
+	struct scheduler_t *s = worker->scheduler;
+	struct task_t task;
+	task.proc = proc;
+	task.arg = arg;
+	task.group = group;
+	if (group) {
+		__atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+	if (!pushTask(&worker->queue, &task)) {
+		runTask(worker, &task);
+		return;
+	}
+	__atomic_add_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST) != 0) {
+		wakeWorkers(s);
+	}
+}
+
+void openTaskGroup(struct taskgroup_t *group, taskproc_t done, void *arg) {
+	group->pending = 1;
+	group->done = done;
+	group->arg = arg;
+}
+
+void closeTaskGroup(struct taskworker_t *worker, struct taskgroup_t *group) {
+	completeGroup(worker, group);
+}
+
+static bool findTask(struct taskworker_t *worker, struct task_t *task) {
+	if (popTask(&worker->queue, task)) {
+		return true;
+	}
+	struct scheduler_t *s = worker->scheduler;
+	for (int i = 1; i < s->count; ++i) {
+		struct taskworker_t *victim = &s->workers[(worker->num + i) % s->count];
+		if (stealTask(&victim->queue, task)) {
+			++worker->steals;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *runWorker(void *arg) {
+	struct taskworker_t *worker = (struct taskworker_t *)arg;
+	struct scheduler_t *s = worker->scheduler;
+	nameTraceThread("worker", worker->num);
+	while (1) {
+		struct task_t task;
+		if (findTask(worker, &task)) {
+			__atomic_sub_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+			runTask(worker, &task);
+			continue;
+		}
+		/* spawnTask wakes the sleeping workers after queuing, runTask once the last task completed */
+		pthread_mutex_lock(&s->idleLock);
+		__atomic_add_fetch(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&s->queued, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&s->pending, __ATOMIC_SEQ_CST) != 0) {
+			pthread_cond_wait(&s->idleCond, &s->idleLock);
+		}
+		__atomic_sub_fetch(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+		const bool done = __atomic_load_n(&s->pending, __ATOMIC_SEQ_CST) == 0;
+		pthread_mutex_unlock(&s->idleLock);
+		if (done) {
+			break;
+		}
+	}
+	return 0;
+}
+
+void runTasks(int threads, taskproc_t proc, void *arg, struct decodestats_t *stats) {
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > MAX_TASK_THREADS) {
+		threads = MAX_TASK_THREADS;
+	}
+	struct scheduler_t s;
+	memset(&s, 0, sizeof(s));
+	pthread_mutex_init(&s.idleLock, 0);
+	pthread_cond_init(&s.idleCond, 0);
+	s.workers = (struct taskworker_t *)calloc(threads, sizeof(struct taskworker_t));
+	if (!s.workers) {
+		return;
+	}
+	for (int i = 0; i < threads; ++i) {
+		struct taskworker_t *worker = &s.workers[i];
+		worker->scheduler = &s;
+		worker->num = i;
+		pthread_mutex_init(&worker->queue.lock, 0);
+		worker->decoder = allocDecoder();
+		if (!worker->decoder) {
+			threads = (i == 0) ? 1 : i;
+			break;
+		}
+	}
+	pthread_t tids[MAX_TASK_THREADS];
+	int started = 0;
+	if (s.workers[0].decoder) {
+		s.count = threads;
+		spawnTask(&s.workers[0], 0, proc, arg);
+		for (; started < threads - 1; ++started) {
+			if (pthread_create(&tids[started], 0, runWorker, &s.workers[started + 1]) != 0) {
+				break;
+			}
+		}
+		runWorker(&s.workers[0]);
+		for (int i = 0; i < started; ++i) {
+			pthread_join(tids[i], 0);
+		}
+	}
+	if (stats) {
+		memset(stats, 0, sizeof(struct decodestats_t));
+	}
+	for (int i = 0; i < threads; ++i) {
+		struct taskworker_t *worker = &s.workers[i];
+		if (stats && worker->decoder) {
+			stats->tasks += worker->tasks;
+			stats->steals += worker->steals;
+			const uint32_t peak = getDecoderPeakSize(worker->decoder);
+			if (stats->arenaPeak < peak) {
+				stats->arenaPeak = peak;
+			}
+		}
+		freeDecoder(worker->decoder);
+		free(worker->queue.tasks);
+		pthread_mutex_destroy(&worker->queue.lock);
+	}
+	free(s.workers);
+	pthread_cond_destroy(&s.idleCond);
+	pthread_mutex_destroy(&s.idleLock);
+}
@@ -0,0 +1,56 @@
+
+#ifndef TASK_H__
+#define TASK_H__
+
+#include <pthread.h>
+#include "decode.h"
+
+/* work stealing pool, each worker runs the tasks it spawned last first and steals the oldest tasks of the others */
+
+struct taskworker_t;
+
+typedef void (*taskproc_t)(struct taskworker_t *worker, void *arg);
+
+struct task_t {
+	taskproc_t proc;
+	void *arg;
+	struct taskgroup_t *group;
+};
+
+/* 'done' is called by the worker completing the last task of the group, once the group is closed */
+struct taskgroup_t {
+	int pending; /* tasks not completed, plus one until closed */
+	taskproc_t done;
+	void *arg;
+};
+
+struct taskqueue_t {
+	pthread_mutex_t lock;
+	struct task_t *tasks; /* ring buffer, 'head' and 'tail' are taken modulo 'capacity' */
+	uint32_t head, tail;
+	uint32_t capacity;
+};
+
+struct scheduler_t;
+
+struct taskworker_t {
+	struct scheduler_t *scheduler;
+	int num;
+	struct decoder_t *decoder; /* the working buffers of the tasks run by this worker */
+	struct taskqueue_t queue;
+	uint32_t tasks, steals;
+};
+
+/* runs 'proc' and the tasks it spawns on 'threads' threads (0 for one per core), returns once all the tasks completed */
+void runTasks(int threads, taskproc_t proc, void *arg, struct decodestats_t *stats);
+/* 'group' can be 0, 'arg' must stay valid until the task is run */
+void spawnTask(struct taskworker_t *worker, struct taskgroup_t *group, taskproc_t proc, void *arg);
+void openTaskGroup(struct taskgroup_t *group, taskproc_t done, void *arg);
+void closeTaskGroup(struct taskworker_t *worker, struct taskgroup_t *group);
+
+/* split the decoding of an asset in tasks */
+void spawnLEVTasks(struct taskworker_t *worker, const char *name, const uint8_t *lev, const uint8_t *mbk, const uint8_t *pal, const uint8_t *sgd, const uint8_t *ct, uint32_t ctSize, int flags);
+void spawnSPCTasks(struct taskworker_t *worker, const char *name, const uint8_t *spc, const uint8_t *mbk);
+void spawnSPRTasks(struct taskworker_t *worker, const char *name, const uint8_t *spr, const uint8_t *tab, int flags);
+
+#endif /* TASK_H__ */
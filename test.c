@@ -0,0 +1,432 @@
+
+#include "tile.h"
+#include "unpack.h"
+
+#define TEST_ITERATIONS 20000
+
+static const char *kKernelNames[] = { "scalar", "sse2", "avx2" };
+
+static uint32_t _seed = 1;
+
+/* xorshift, the same sequence on every platform */
+static uint32_t getRandom(void) {
+	_seed ^= _seed << 13;
+	_seed ^= _seed >> 17;
+	_seed ^= _seed << 5;
+	return _seed;
+}
+
+static void fillRandom(uint8_t *dst, int size) {
+	for (int i = 0; i < size; ++i) {
+		dst[i] = getRandom();
+	}
+}
+
+/* each kernel draws over the same random destination as the scalar one, the bytes outside of the tile are compared too */
+static int testExpandTile(int kernel, bool mask) {
+	int failures = 0;
+	for (int i = 0; i < TEST_ITERATIONS; ++i) {
+		uint8_t src[32];
+		fillRandom(src, sizeof(src));
+		const int pitch = 8 + getRandom() % 57;
+		const int x = getRandom() % 16;
+		const uint8_t offset = getRandom();
+		uint8_t init[8 * 80], ref[8 * 80], out[8 * 80];
+		fillRandom(init, sizeof(init));
+		memcpy(ref, init, sizeof(ref));
+		memcpy(out, init, sizeof(out));
+		setTileKernel(kTileKernelScalar);
+		if (mask) {
+			expandMaskTile8x8(ref + x, pitch, src, offset);
+		} else {
+			expandTile8x8(ref + x, pitch, src, offset);
+		}
+		setTileKernel(kernel);
+		if (mask) {
+			expandMaskTile8x8(out + x, pitch, src, offset);
+		} else {
+			expandTile8x8(out + x, pitch, src, offset);
+		}
+		if (memcmp(ref, out, sizeof(ref)) != 0) {
+			if (failures == 0) {
+				fprintf(stderr, "%s %s: pitch %d x %d offset %d differs\n", mask ? "expandMaskTile8x8" : "expandTile8x8", kKernelNames[kernel], pitch, x, offset);
+			}
+			++failures;
+		}
+	}
+	return failures;
+}
+
+static int testDrawMaskRow(int kernel) {
+	int failures = 0;
+	for (int i = 0; i < TEST_ITERATIONS; ++i) {
+		const int count = 1 + getRandom() % 8;
+		const int x = getRandom() % 16;
+		uint8_t bits[2 * 8], colors[8 * 8];
+		fillRandom(bits, sizeof(bits));
+		fillRandom(colors, sizeof(colors));
+		uint8_t init[16 + 16 * 8 + 16], ref[16 + 16 * 8 + 16], out[16 + 16 * 8 + 16];
+		fillRandom(init, sizeof(init));
+		memcpy(ref, init, sizeof(ref));
+		memcpy(out, init, sizeof(out));
+		setTileKernel(kTileKernelScalar);
+		drawMaskRow16(ref + x, bits, colors, count);
+		setTileKernel(kernel);
+		drawMaskRow16(out + x, bits, colors, count);
+		if (memcmp(ref, out, sizeof(ref)) != 0) {
+			if (failures == 0) {
+				fprintf(stderr, "drawMaskRow16 %s: count %d x %d differs\n", kKernelNames[kernel], count, x);
+			}
+			++failures;
+		}
+	}
+	return failures;
+}
+
+/* compares the SIMD kernels supported by the CPU with the scalar one */
+static int testTileKernels(void) {
+	int failures = 0;
+	for (int kernel = kTileKernelScalar + 1; kernel <= kTileKernelAVX2; ++kernel) {
+		if (setTileKernel(kernel) != kernel) {
+			fprintf(stdout, "  %s kernel not supported\n", kKernelNames[kernel]);
+			continue;
+		}
+		failures += testExpandTile(kernel, false);
+		failures += testExpandTile(kernel, true);
+		failures += testDrawMaskRow(kernel);
+		fprintf(stdout, "  %s kernel checked\n", kKernelNames[kernel]);
+	}
+	setTileKernel(kTileKernelAVX2);
+	return failures;
+}
+
+#define ROOM_W 256
+#define ROOM_H 224
+#define ROOM_GUARD 64 /* rows around the room, nothing is drawn there */
+
+/* decodeTileSGD before the shapes were clipped once, each pixel pair is tested, including the one ending on the last column */
+static void drawShapeReference(uint8_t *dst, int dstPitch, int x0, int y0, int w, int h, const uint8_t *src, const uint8_t *mask) {
+	dst += y0 * dstPitch + x0;
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			const uint16_t bits = READ_BE_UINT16(src); src += 2;
+			uint16_t bitmask = 0x8000;
+			for (int b = 0; b < 16; b += 2) {
+				const int offset = x * 16 + b;
+				const uint8_t color = *mask++;
+				if (y0 + y < 0 || y0 + y >= ROOM_H) {
+					bitmask >>= 2;
+					continue;
+				}
+				if (x0 + offset < 0 || x0 + offset + 1 >= ROOM_W) {
+					bitmask >>= 2;
+					continue;
+				}
+				if (bits & bitmask) {
+					dst[offset] = color >> 4;
+				}
+				bitmask >>= 1;
+				if (bits & bitmask) {
+					dst[offset + 1] = color & 15;
+				}
+				bitmask >>= 1;
+			}
+		}
+		dst += dstPitch;
+	}
+}
+
+/* random shapes, fully inside, across each edge of the room and fully outside */
+static int testShapes(void) {
+	static uint8_t ref[(ROOM_H + 2 * ROOM_GUARD) * ROOM_W], out[(ROOM_H + 2 * ROOM_GUARD) * ROOM_W];
+	uint8_t *refRoom = ref + ROOM_GUARD * ROOM_W;
+	uint8_t *outRoom = out + ROOM_GUARD * ROOM_W;
+	int failures = 0;
+	for (int kernel = kTileKernelScalar; kernel <= kTileKernelAVX2; ++kernel) {
+		if (setTileKernel(kernel) != kernel) {
+			continue;
+		}
+		for (int i = 0; i < TEST_ITERATIONS; ++i) {
+			const int w = 1 + getRandom() % 8;
+			const int h = 1 + getRandom() % (ROOM_GUARD - 8);
+			const int x = (int)(getRandom() % (ROOM_W + 2 * w * 16)) - w * 16 - 8;
+			const int y = (int)(getRandom() % (ROOM_H + 2 * h)) - h - 4;
+			uint8_t src[2 * 8 * ROOM_GUARD], mask[8 * 8 * ROOM_GUARD];
+			fillRandom(src, w * 2 * h);
+			fillRandom(mask, w * 8 * h);
+			const uint8_t fill = getRandom();
+			memset(ref, fill, sizeof(ref));
+			memset(out, fill, sizeof(out));
+			drawShapeReference(refRoom, ROOM_W, x, y, w, h, src, mask);
+			drawMaskShape16(outRoom, ROOM_W, ROOM_W, ROOM_H, x, y, w, h, src, mask);
+			if (memcmp(ref, out, sizeof(ref)) != 0) {
+				if (failures == 0) {
+					fprintf(stderr, "drawMaskShape16 %s: %dx%d words at %d,%d differs\n", kKernelNames[kernel], w, h, x, y);
+				}
+				++failures;
+			}
+		}
+		fprintf(stdout, "  %s kernel checked\n", kKernelNames[kernel]);
+	}
+	setTileKernel(kTileKernelAVX2);
+	return failures;
+}
+
+struct unpackref_t {
+	int size;
+	uint32_t crc;
+	uint32_t bits;
+	uint8_t *dst;
+	const uint8_t *src;
+};
+
+/* bytekiller_unpack before the bits were buffered, one bit at a time */
+static int nextBitReference(struct unpackref_t *uc) {
+	int carry = (uc->bits & 1) != 0;
+	uc->bits >>= 1;
+	if (uc->bits == 0) { // getnextlwd
+		uc->bits = READ_BE_UINT32(uc->src); uc->src -= 4;
+		uc->crc ^= uc->bits;
+		carry = (uc->bits & 1) != 0;
+		uc->bits = (1 << 31) | (uc->bits >> 1);
+	}
+	return carry;
+}
+
+static int getBitsReference(struct unpackref_t *uc, int count) { // rdd1bits
+	int bits = 0;
+	for (int i = 0; i < count; ++i) {
+		bits |= nextBitReference(uc) << (count - 1 - i);
+	}
+	return bits;
+}
+
+static void copyLiteralReference(struct unpackref_t *uc, int bitsCount, int len) { // getd3chr
+	int count = getBitsReference(uc, bitsCount) + len + 1;
+	uc->size -= count;
+	if (uc->size < 0) {
+		count += uc->size;
+		uc->size = 0;
+	}
+	for (int i = 0; i < count; ++i) {
+		*(uc->dst - i) = (uint8_t)getBitsReference(uc, 8);
+	}
+	uc->dst -= count;
+}
+
+static void copyReferenceReference(struct unpackref_t *uc, int bitsCount, int count) { // copyd3bytes
+	uc->size -= count;
+	if (uc->size < 0) {
+		count += uc->size;
+		uc->size = 0;
+	}
+	const int offset = getBitsReference(uc, bitsCount);
+	for (int i = 0; i < count; ++i) {
+		*(uc->dst - i) = *(uc->dst - i + offset);
+	}
+	uc->dst -= count;
+}
+
+static uint32_t unpackReference(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize) {
+	struct unpackref_t uc;
+	uc.src = src + srcSize - 4;
+	uc.size = READ_BE_UINT32(uc.src); uc.src -= 4;
+	if (uc.size > dstSize) {
+		return 0;
+	}
+	uc.dst = dst + uc.size - 1;
+	uc.crc = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.bits = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.crc ^= uc.bits;
+	do {
+		if (!nextBitReference(&uc)) {
+			if (!nextBitReference(&uc)) {
+				copyLiteralReference(&uc, 3, 0);
+			} else {
+				copyReferenceReference(&uc, 8, 2);
+			}
+		} else {
+			switch (getBitsReference(&uc, 2)) {
+			case 3:
+				copyLiteralReference(&uc, 8, 8);
+				break;
+			case 2:
+				copyReferenceReference(&uc, 12, getBitsReference(&uc, 8) + 1);
+				break;
+			case 1:
+				copyReferenceReference(&uc, 10, 4);
+				break;
+			case 0:
+				copyReferenceReference(&uc, 9, 3);
+				break;
+			}
+		}
+	} while (uc.size > 0);
+	return uc.crc;
+}
+
+#define PACK_MAX_SIZE 4096
+#define PACK_MAX_BITS (PACK_MAX_SIZE * 13) /* a one byte literal per byte */
+
+/* the bits in the order the decoder reads them */
+struct packer_t {
+	uint8_t bits[PACK_MAX_BITS];
+	int count;
+};
+
+static void putBits(struct packer_t *p, uint32_t value, int count) {
+	for (int i = count - 1; i >= 0; --i) {
+		p->bits[p->count++] = (value >> i) & 1;
+	}
+}
+
+static void writeUint32BE(uint8_t *dst, uint32_t value) {
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+}
+
+/* the first word holds the bits left over by the full words under its highest set bit, the words are stored backwards */
+static int writePackedStream(const struct packer_t *p, uint8_t *src, int size, uint32_t crcError) {
+	const int firstCount = p->count % 32;
+	const int words = 1 + p->count / 32;
+	uint8_t *end = src + 4 * (words + 2);
+	uint32_t crc = crcError;
+	const uint8_t *bit = p->bits;
+	for (int i = 0; i < words; ++i) {
+		const int count = (i == 0) ? firstCount : 32;
+		uint32_t word = (i == 0) ? (1U << firstCount) : 0;
+		for (int j = 0; j < count; ++j) {
+			word |= (uint32_t)*bit++ << j;
+		}
+		crc ^= word;
+		writeUint32BE(end - 12 - 4 * i, word);
+	}
+	writeUint32BE(end - 8, crc);
+	writeUint32BE(end - 4, size);
+	return end - src;
+}
+
+/* packs 'size' random bytes with random opcodes, the last one cut by the end of the output */
+static void packRandomStream(struct packer_t *p, int size, uint32_t *opsMask) {
+	p->count = 0;
+	int written = 0;
+	while (written < size) {
+		const int op = (written == 0) ? ((getRandom() & 1) ? kOpLiteral8 : kOpLiteral3) : (int)(getRandom() % kOpCount);
+		*opsMask |= 1 << op;
+		int count = 0, offsetBits = 0;
+		switch (op) {
+		case kOpLiteral3:
+			putBits(p, 0, 2);
+			count = getRandom() % 8;
+			putBits(p, count, 3);
+			count += 1;
+			break;
+		case kOpLiteral8:
+			putBits(p, 7, 3);
+			count = getRandom() % 256;
+			putBits(p, count, 8);
+			count += 9;
+			break;
+		case kOpReference8:
+			putBits(p, 1, 2);
+			count = 2;
+			offsetBits = 8;
+			break;
+		case kOpReference9:
+			putBits(p, 4, 3);
+			count = 3;
+			offsetBits = 9;
+			break;
+		case kOpReference10:
+			putBits(p, 5, 3);
+			count = 4;
+			offsetBits = 10;
+			break;
+		case kOpReference12:
+			putBits(p, 6, 3);
+			count = getRandom() % 256;
+			putBits(p, count, 8);
+			count += 1;
+			offsetBits = 12;
+			break;
+		}
+		if (count > size - written) {
+			count = size - written;
+		}
+		if (offsetBits == 0) {
+			for (int i = 0; i < count; ++i) {
+				putBits(p, getRandom() & 255, 8);
+			}
+		} else {
+			/* short offsets overlap the bytes being copied */
+			const int maxOffset = (1 << offsetBits) - 1;
+			const int range = (written < maxOffset) ? written : maxOffset;
+			const int offset = 1 + ((getRandom() & 1) ? getRandom() % range : getRandom() % (range < 8 ? range : 8));
+			putBits(p, offset, offsetBits);
+		}
+		written += count;
+	}
+}
+
+/* packed streams against the original decoder, the output and the returned crc are compared for both reference copies */
+static int testUnpack(void) {
+	static struct packer_t packer;
+	static uint8_t src[PACK_MAX_BITS / 8 + 64];
+	static uint8_t ref[PACK_MAX_SIZE + 64], out[PACK_MAX_SIZE + 64];
+	uint32_t opsMask = 0, firstCounts = 0;
+	int failures = 0;
+	for (int byteCopy = 0; byteCopy < 2; ++byteCopy) {
+		setUnpackByteCopy(byteCopy);
+		for (int i = 0; i < TEST_ITERATIONS / 2; ++i) {
+			const int size = 1 + ((getRandom() & 1) ? getRandom() % PACK_MAX_SIZE : getRandom() % 64);
+			packRandomStream(&packer, size, &opsMask);
+			firstCounts |= 1U << (packer.count % 32);
+			/* the decoders return the crc error, 0 for a valid stream */
+			const uint32_t crcError = (getRandom() % 8 == 0) ? getRandom() : 0;
+			/* the bytes before the stream are random, reading past it changes the crc */
+			const int offset = 16 + getRandom() % 16;
+			fillRandom(src, offset);
+			const int srcSize = writePackedStream(&packer, src + offset, size, crcError);
+			const uint8_t fill = getRandom();
+			memset(ref, fill, sizeof(ref));
+			memset(out, fill, sizeof(out));
+			const uint32_t refCrc = unpackReference(ref + 32, size, src + offset, srcSize);
+			const uint32_t outCrc = bytekiller_unpack(out + 32, size, src + offset, srcSize);
+			if (refCrc != crcError || outCrc != refCrc || memcmp(ref, out, sizeof(ref)) != 0) {
+				if (failures == 0) {
+					fprintf(stderr, "bytekiller_unpack%s: size %d bits %d crc 0x%08X expected 0x%08X differs\n", byteCopy ? " byte copy" : "", size, packer.count, outCrc, crcError);
+				}
+				++failures;
+			}
+		}
+	}
+	setUnpackByteCopy(0);
+	if (opsMask != (1U << kOpCount) - 1 || firstCounts != 0xFFFFFFFF) {
+		fprintf(stderr, "bytekiller_unpack: opcodes 0x%X first word bits 0x%08X not all packed\n", opsMask, firstCounts);
+		++failures;
+	}
+	return failures;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} _tests[] = {
+	{ "tile_kernels", testTileKernels },
+	{ "sgd_shapes", testShapes },
+	{ "bytekiller", testUnpack },
+	{ 0, 0 }
+};
+
+int main(void) {
+	int failed = 0;
+	for (int i = 0; _tests[i].name; ++i) {
+		fprintf(stdout, "%s\n", _tests[i].name);
+		const int failures = (_tests[i].run)();
+		fprintf(stdout, "%s: %s\n", _tests[i].name, (failures == 0) ? "ok" : "FAILED");
+		failed += (failures != 0);
+	}
+	return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+
+#include "tile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TILE_X86 1
+#include <immintrin.h>
+#endif
+
+static void expandTile8x8_scalar(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	for (int y = 0; y < 8; ++y, dst += dstPitch) {
+		for (int i = 0; i < 4; ++i) {
+			const uint8_t color = *src++;
+			dst[2 * i]     = (color >> 4) + offset;
+			dst[2 * i + 1] = (color & 15) + offset;
+		}
+	}
+}
+
+static void expandMaskTile8x8_scalar(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	for (int y = 0; y < 8; ++y, dst += dstPitch) {
+		for (int i = 0; i < 4; ++i) {
+			const uint8_t color = *src++;
+			if ((color >> 4) != 0) {
+				dst[2 * i] = (color >> 4) + offset;
+			}
+			if ((color & 15) != 0) {
+				dst[2 * i + 1] = (color & 15) + offset;
+			}
+		}
+	}
+}
+
+static void drawMaskRow16_scalar(uint8_t *dst, const uint8_t *bits, const uint8_t *colors, int count) {
+	for (int x = 0; x < count; ++x, dst += 16, bits += 2) {
+		const uint16_t mask = READ_BE_UINT16(bits);
+		for (int i = 0; i < 8; ++i) {
+			const uint8_t color = *colors++;
+			if (mask & (0x8000 >> (2 * i))) {
+				dst[2 * i] = color >> 4;
+			}
+			if (mask & (0x4000 >> (2 * i))) {
+				dst[2 * i + 1] = color & 15;
+			}
+		}
+	}
+}
+
+#ifdef TILE_X86
+
+/* each 16 bytes register holds 2 rows of 8 pixels */
+static inline void storeRows(uint8_t *dst, int dstPitch, __m128i rows) {
+	_mm_storel_epi64((__m128i *)dst, rows);
+	_mm_storel_epi64((__m128i *)(dst + dstPitch), _mm_unpackhi_epi64(rows, rows));
+}
+
+static inline __m128i loadRows(const uint8_t *dst, int dstPitch) {
+	return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)dst), _mm_loadl_epi64((const __m128i *)(dst + dstPitch)));
+}
+
+/* pixels with color 0 keep the destination value */
+static inline void storeMaskRows(uint8_t *dst, int dstPitch, __m128i rows, __m128i colors) {
+	const __m128i transparent = _mm_cmpeq_epi8(colors, _mm_setzero_si128());
+	const __m128i current = loadRows(dst, dstPitch);
+	storeRows(dst, dstPitch, _mm_or_si128(_mm_and_si128(transparent, current), _mm_andnot_si128(transparent, rows)));
+}
+
+__attribute__((target("sse2")))
+static void expandTile8x8_sse2(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	const __m128i nibbles = _mm_set1_epi8(15);
+	const __m128i add = _mm_set1_epi8(offset);
+	for (int i = 0; i < 2; ++i, src += 16) {
+		const __m128i packed = _mm_loadu_si128((const __m128i *)src);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), nibbles);
+		const __m128i lo = _mm_and_si128(packed, nibbles);
+		storeRows(dst, dstPitch, _mm_add_epi8(_mm_unpacklo_epi8(hi, lo), add));
+		dst += 2 * dstPitch;
+		storeRows(dst, dstPitch, _mm_add_epi8(_mm_unpackhi_epi8(hi, lo), add));
+		dst += 2 * dstPitch;
+	}
+}
+
+__attribute__((target("sse2")))
+static void expandMaskTile8x8_sse2(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	const __m128i nibbles = _mm_set1_epi8(15);
+	const __m128i add = _mm_set1_epi8(offset);
+	for (int i = 0; i < 2; ++i, src += 16) {
+		const __m128i packed = _mm_loadu_si128((const __m128i *)src);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), nibbles);
+		const __m128i lo = _mm_and_si128(packed, nibbles);
+		const __m128i colors0 = _mm_unpacklo_epi8(hi, lo);
+		const __m128i colors1 = _mm_unpackhi_epi8(hi, lo);
+		storeMaskRows(dst, dstPitch, _mm_add_epi8(colors0, add), colors0);
+		dst += 2 * dstPitch;
+		storeMaskRows(dst, dstPitch, _mm_add_epi8(colors1, add), colors1);
+		dst += 2 * dstPitch;
+	}
+}
+
+/* the unpack instructions work on each 128 bits lane, the low lane holds rows 0-3 and the high lane rows 4-7 */
+__attribute__((target("avx2")))
+static void expandTile8x8_avx2(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	const __m256i packed = _mm256_loadu_si256((const __m256i *)src);
+	const __m256i nibbles = _mm256_set1_epi8(15);
+	const __m256i add = _mm256_set1_epi8(offset);
+	const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(packed, 4), nibbles);
+	const __m256i lo = _mm256_and_si256(packed, nibbles);
+	const __m256i rows0 = _mm256_add_epi8(_mm256_unpacklo_epi8(hi, lo), add); /* rows 0-1, 4-5 */
+	const __m256i rows1 = _mm256_add_epi8(_mm256_unpackhi_epi8(hi, lo), add); /* rows 2-3, 6-7 */
+	storeRows(dst, dstPitch, _mm256_castsi256_si128(rows0));
+	storeRows(dst + 2 * dstPitch, dstPitch, _mm256_castsi256_si128(rows1));
+	storeRows(dst + 4 * dstPitch, dstPitch, _mm256_extracti128_si256(rows0, 1));
+	storeRows(dst + 6 * dstPitch, dstPitch, _mm256_extracti128_si256(rows1, 1));
+}
+
+__attribute__((target("avx2")))
+static void expandMaskTile8x8_avx2(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	const __m256i packed = _mm256_loadu_si256((const __m256i *)src);
+	const __m256i nibbles = _mm256_set1_epi8(15);
+	const __m256i add = _mm256_set1_epi8(offset);
+	const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(packed, 4), nibbles);
+	const __m256i lo = _mm256_and_si256(packed, nibbles);
+	const __m256i colors0 = _mm256_unpacklo_epi8(hi, lo);
+	const __m256i colors1 = _mm256_unpackhi_epi8(hi, lo);
+	const __m256i rows0 = _mm256_add_epi8(colors0, add);
+	const __m256i rows1 = _mm256_add_epi8(colors1, add);
+	storeMaskRows(dst, dstPitch, _mm256_castsi256_si128(rows0), _mm256_castsi256_si128(colors0));
+	storeMaskRows(dst + 2 * dstPitch, dstPitch, _mm256_castsi256_si128(rows1), _mm256_castsi256_si128(colors1));
+	storeMaskRows(dst + 4 * dstPitch, dstPitch, _mm256_extracti128_si256(rows0, 1), _mm256_extracti128_si256(colors0, 1));
+	storeMaskRows(dst + 6 * dstPitch, dstPitch, _mm256_extracti128_si256(rows1, 1), _mm256_extracti128_si256(colors1, 1));
+}
+
+/* 16 pixels per register, the same for AVX2 */
+__attribute__((target("sse2")))
+static void drawMaskRow16_sse2(uint8_t *dst, const uint8_t *bits, const uint8_t *colors, int count) {
+	const __m128i nibbles = _mm_set1_epi8(15);
+	const __m128i pattern = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1, (char)0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+	for (int x = 0; x < count; ++x, dst += 16, bits += 2, colors += 8) {
+		const __m128i packed = _mm_loadl_epi64((const __m128i *)colors);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), nibbles);
+		const __m128i lo = _mm_and_si128(packed, nibbles);
+		const __m128i pixels = _mm_unpacklo_epi8(hi, lo);
+		const __m128i mask = _mm_unpacklo_epi64(_mm_set1_epi8(bits[0]), _mm_set1_epi8(bits[1]));
+		const __m128i opaque = _mm_cmpeq_epi8(_mm_and_si128(mask, pattern), pattern);
+		const __m128i current = _mm_loadu_si128((const __m128i *)dst);
+		_mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(opaque, pixels), _mm_andnot_si128(opaque, current)));
+	}
+}
+
+#endif
+
+typedef void (*expandTileProc)(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset);
+typedef void (*drawMaskRowProc)(uint8_t *dst, const uint8_t *bits, const uint8_t *colors, int count);
+
+static const struct {
+	expandTileProc expand;
+	expandTileProc expandMask;
+	drawMaskRowProc drawMaskRow;
+} _kernels[] = {
+	{ expandTile8x8_scalar, expandMaskTile8x8_scalar, drawMaskRow16_scalar },
+#ifdef TILE_X86
+	{ expandTile8x8_sse2, expandMaskTile8x8_sse2, drawMaskRow16_sse2 },
+	{ expandTile8x8_avx2, expandMaskTile8x8_avx2, drawMaskRow16_sse2 },
+#endif
+};
+
+static int _kernel = -1;
+
+static bool isKernelSupported(int kernel) {
+#ifdef TILE_X86
+	switch (kernel) {
+	case kTileKernelSSE2:
+		return __builtin_cpu_supports("sse2");
+	case kTileKernelAVX2:
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return kernel == kTileKernelScalar;
+}
+
+int setTileKernel(int kernel) {
+	while (kernel > kTileKernelScalar && !isKernelSupported(kernel)) {
+		--kernel;
+	}
+	__atomic_store_n(&_kernel, kernel, __ATOMIC_RELAXED);
+	return kernel;
+}
+
+int getTileKernel(void) {
+	const int kernel = __atomic_load_n(&_kernel, __ATOMIC_RELAXED);
+	return (kernel < 0) ? setTileKernel(kTileKernelAVX2) : kernel;
+}
+
+void expandTile8x8(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	_kernels[getTileKernel()].expand(dst, dstPitch, src, offset);
+}
+
+void expandMaskTile8x8(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset) {
+	_kernels[getTileKernel()].expandMask(dst, dstPitch, src, offset);
+}
+
+void drawMaskRow16(uint8_t *dst, const uint8_t *bits, const uint8_t *colors, int count) {
+	_kernels[getTileKernel()].drawMaskRow(dst, bits, colors, count);
+}
+
+/* clipped once, the rows fully inside are drawn with drawMaskRow16 */
+void drawMaskShape16(uint8_t *dst, int dstPitch, int clipW, int clipH, int x0, int y0, int w, int h, const uint8_t *bits, const uint8_t *colors) {
+	const int yBegin = (y0 < 0) ? -y0 : 0;
+	const int yEnd = (y0 + h > clipH) ? clipH - y0 : h;
+	/* pixel pairs, x0 + 2 * p >= 0 and x0 + 2 * p + 1 < clipW */
+	const int pairs = w * 8;
+	const int pBegin = (x0 < 0) ? (1 - x0) / 2 : 0;
+	int pEnd = (clipW - 2 - x0 < 0) ? 0 : (clipW - 2 - x0) / 2 + 1;
+	if (pEnd > pairs) {
+		pEnd = pairs;
+	}
+	if (yBegin >= yEnd || pBegin >= pEnd) {
+		return;
+	}
+	if (pBegin == 0 && pEnd == pairs) {
+		for (int y = yBegin; y < yEnd; ++y) {
+			drawMaskRow16(dst + (y0 + y) * dstPitch + x0, bits + y * w * 2, colors + y * w * 8, w);
+		}
+		return;
+	}
+	for (int y = yBegin; y < yEnd; ++y) {
+		uint8_t *p = dst + (y0 + y) * dstPitch + x0 + pBegin * 2;
+		const uint8_t *rowBits = bits + y * w * 2;
+		const uint8_t *rowColors = colors + y * w * 8;
+		for (int i = pBegin; i < pEnd; ++i, p += 2) {
+			const uint16_t bitmask = 0x8000 >> ((i & 7) * 2);
+			const uint16_t word = READ_BE_UINT16(rowBits + (i >> 3) * 2);
+			if (word & bitmask) {
+				p[0] = rowColors[i] >> 4;
+			}
+			if (word & (bitmask >> 1)) {
+				p[1] = rowColors[i] & 15;
+			}
+		}
+	}
+}
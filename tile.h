@@ -0,0 +1,28 @@
+
+#ifndef TILE_H__
+#define TILE_H__
+
+#include "intern.h"
+
+/* 8x8 tiles, 4 bits per pixel, high nibble first (32 bytes) */
+
+enum {
+	kTileKernelScalar,
+	kTileKernelSSE2,
+	kTileKernelAVX2
+};
+
+/* expands to 8 bits per pixel, 'offset' is added to each pixel */
+void expandTile8x8(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset);
+/* same as expandTile8x8, pixels with color 0 are transparent and not written */
+void expandMaskTile8x8(uint8_t *dst, int dstPitch, const uint8_t *src, uint8_t offset);
+/* 'count' words of 16 pixels, 'colors' holds 4 bits per pixel and 'bits' one big-endian bit per pixel, msb first, pixels with a clear bit are not written */
+void drawMaskRow16(uint8_t *dst, const uint8_t *bits, const uint8_t *colors, int count);
+/* 'h' rows of 'w' words, as drawMaskRow16, at 'x0', 'y0' in a 'clipW' x 'clipH' bitmap, a pair of pixels is only drawn if both are inside */
+void drawMaskShape16(uint8_t *dst, int dstPitch, int clipW, int clipH, int x0, int y0, int w, int h, const uint8_t *bits, const uint8_t *colors);
+
+/* the best kernel supported by the CPU is used by default, returns the kernel actually selected */
+int setTileKernel(int kernel);
+int getTileKernel(void);
+
+#endif /* TILE_H__ */
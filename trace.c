@@ -0,0 +1,225 @@
+
+#include <inttypes.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_CHUNK_EVENTS 4096
+
+struct traceevent_t {
+	const char *cat, *name;
+	uint64_t start, duration; /* ns */
+	int argsCount;
+	const char *argNames[TRACE_ARGS];
+	int32_t args[TRACE_ARGS];
+};
+
+struct tracechunk_t {
+	struct tracechunk_t *next;
+	int count;
+	struct traceevent_t events[TRACE_CHUNK_EVENTS];
+};
+
+/* only appended to by its thread */
+struct tracebuffer_t {
+	struct tracebuffer_t *next;
+	int tid;
+	char name[32];
+	struct tracechunk_t *head, *tail;
+};
+
+static int _traceEnabled;
+static uint32_t _traceGeneration;
+static uint64_t _traceStart;
+static struct tracebuffer_t *_traceBuffers;
+static int _traceThreads;
+
+/* the buffer of a previous trace is freed, 'generation' tells if it is still valid */
+static _Thread_local struct tracebuffer_t *_threadBuffer;
+static _Thread_local uint32_t _threadGeneration;
+
+static uint64_t getTimeNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void freeTraceBuffers(void) {
+	struct tracebuffer_t *b = _traceBuffers;
+	while (b) {
+		struct tracebuffer_t *next = b->next;
+		struct tracechunk_t *chunk = b->head;
+		while (chunk) {
+			struct tracechunk_t *nextChunk = chunk->next;
+			free(chunk);
+			chunk = nextChunk;
+		}
+		free(b);
+		b = next;
+	}
+	_traceBuffers = 0;
+}
+
+void startTrace(void) {
+	__atomic_store_n(&_traceEnabled, 0, __ATOMIC_RELAXED);
+	freeTraceBuffers();
+	_traceThreads = 0;
+	_traceStart = getTimeNs();
+	__atomic_add_fetch(&_traceGeneration, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&_traceEnabled, 1, __ATOMIC_RELEASE);
+}
+
+void stopTrace(void) {
+	__atomic_store_n(&_traceEnabled, 0, __ATOMIC_RELAXED);
+}
+
+static bool isTracing(void) {
+	return __atomic_load_n(&_traceEnabled, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* the buffers are pushed on the list without locking, the list is only walked once the threads are done */
+static struct tracebuffer_t *getThreadBuffer(void) {
+	const uint32_t generation = __atomic_load_n(&_traceGeneration, __ATOMIC_RELAXED);
+	if (_threadBuffer && _threadGeneration == generation) {
+		return _threadBuffer;
+	}
+	struct tracebuffer_t *b = (struct tracebuffer_t *)calloc(1, sizeof(struct tracebuffer_t));
+	if (!b) {
+		return 0;
+	}
+	b->tid = __atomic_add_fetch(&_traceThreads, 1, __ATOMIC_RELAXED);
+	b->next = __atomic_load_n(&_traceBuffers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&_traceBuffers, &b->next, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+	_threadBuffer = b;
+	_threadGeneration = generation;
+	return b;
+}
+
+void nameTraceThread(const char *name, int num) {
+	if (isTracing()) {
+		struct tracebuffer_t *b = getThreadBuffer();
+		if (b) {
+			snprintf(b->name, sizeof(b->name), "%s %d", name, num);
+		}
+	}
+}
+
+void beginTraceScope(struct tracescope_t *scope, const char *cat, const char *name) {
+	scope->start = 0;
+	scope->argsCount = 0;
+	if (isTracing()) {
+		scope->cat = cat;
+		scope->name = name;
+		scope->start = getTimeNs();
+	}
+}
+
+void addTraceArg(struct tracescope_t *scope, const char *name, int32_t value) {
+	if (scope->start != 0 && scope->argsCount < TRACE_ARGS) {
+		scope->argNames[scope->argsCount] = name;
+		scope->args[scope->argsCount] = value;
+		++scope->argsCount;
+	}
+}
+
+void endTraceScope(struct tracescope_t *scope) {
+	if (scope->start == 0) {
+		return;
+	}
+	const uint64_t end = getTimeNs();
+	struct tracebuffer_t *b = getThreadBuffer();
+	if (!b) {
+		return;
+	}
+	if (!b->tail || b->tail->count == TRACE_CHUNK_EVENTS) {
+		struct tracechunk_t *chunk = (struct tracechunk_t *)malloc(sizeof(struct tracechunk_t));
+		if (!chunk) {
+			return;
+		}
+		chunk->next = 0;
+		chunk->count = 0;
+		if (b->tail) {
+			b->tail->next = chunk;
+		} else {
+			b->head = chunk;
+		}
+		b->tail = chunk;
+	}
+	struct traceevent_t *e = &b->tail->events[b->tail->count++];
+	e->cat = scope->cat;
+	e->name = scope->name;
+	e->start = scope->start;
+	e->duration = end - scope->start;
+	e->argsCount = scope->argsCount;
+	for (int i = 0; i < scope->argsCount; ++i) {
+		e->argNames[i] = scope->argNames[i];
+		e->args[i] = scope->args[i];
+	}
+}
+
+struct tracerecord_t {
+	const struct traceevent_t *event;
+	int tid;
+};
+
+static int compareRecords(const void *a, const void *b) {
+	const uint64_t startA = ((const struct tracerecord_t *)a)->event->start;
+	const uint64_t startB = ((const struct tracerecord_t *)b)->event->start;
+	return (startA > startB) - (startA < startB);
+}
+
+bool saveTrace(const char *filename) {
+	struct tracebuffer_t *buffers = __atomic_load_n(&_traceBuffers, __ATOMIC_ACQUIRE);
+	int count = 0;
+	for (const struct tracebuffer_t *b = buffers; b; b = b->next) {
+		for (const struct tracechunk_t *chunk = b->head; chunk; chunk = chunk->next) {
+			count += chunk->count;
+		}
+	}
+	/* the events of all the threads in time order */
+	struct tracerecord_t *records = (struct tracerecord_t *)malloc((count ? count : 1) * sizeof(struct tracerecord_t));
+	if (!records) {
+		return false;
+	}
+	int i = 0;
+	for (const struct tracebuffer_t *b = buffers; b; b = b->next) {
+		for (const struct tracechunk_t *chunk = b->head; chunk; chunk = chunk->next) {
+			for (int j = 0; j < chunk->count; ++j, ++i) {
+				records[i].event = &chunk->events[j];
+				records[i].tid = b->tid;
+			}
+		}
+	}
+	qsort(records, count, sizeof(struct tracerecord_t), compareRecords);
+	FILE *fp = fopen(filename, "w");
+	if (!fp) {
+		free(records);
+		return false;
+	}
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"fb_decode\"}}");
+	for (const struct tracebuffer_t *b = buffers; b; b = b->next) {
+		if (b->name[0]) {
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", b->tid, b->name);
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		const struct traceevent_t *e = records[i].event;
+		if (e->start < _traceStart) {
+			continue;
+		}
+		fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+			e->name, e->cat, records[i].tid, (e->start - _traceStart) / 1000., e->duration / 1000.);
+		if (e->argsCount != 0) {
+			fprintf(fp, ",\"args\":{");
+			for (int j = 0; j < e->argsCount; ++j) {
+				fprintf(fp, "%s\"%s\":%" PRId32, (j == 0) ? "" : ",", e->argNames[j], e->args[j]);
+			}
+			fprintf(fp, "}");
+		}
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n]}\n");
+	free(records);
+	return fclose(fp) == 0;
+}
@@ -0,0 +1,32 @@
+
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include "intern.h"
+
+/* timeline of the decoding in the Chrome trace event format, each thread appends to its own buffer */
+
+#define TRACE_ARGS 2
+
+struct tracescope_t {
+	const char *cat, *name; /* static strings */
+	uint64_t start; /* ns, 0 if not traced */
+	int argsCount;
+	const char *argNames[TRACE_ARGS];
+	int32_t args[TRACE_ARGS];
+};
+
+/* drops the previous events, to be called while no other thread is tracing */
+void startTrace(void);
+void stopTrace(void);
+/* merges the buffers of all the threads, once they are done */
+bool saveTrace(const char *filename);
+
+/* names the calling thread in the trace, 'num' is appended */
+void nameTraceThread(const char *name, int num);
+
+void beginTraceScope(struct tracescope_t *scope, const char *cat, const char *name);
+void addTraceArg(struct tracescope_t *scope, const char *name, int32_t value);
+void endTraceScope(struct tracescope_t *scope);
+
+#endif /* TRACE_H__ */
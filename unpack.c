@@ -1,32 +1,59 @@
 
+#include "metrics.h"
+#include "trace.h"
 #include "unpack.h"
 
 struct unpack_t {
 	int size;
 	uint32_t crc;
-	uint32_t bits;
+	uint64_t bits; /* msb first */
+	int count; /* number of valid bits in 'bits' */
 	uint8_t *dst;
 	const uint8_t *src;
 };
 
-static int nextBit(struct unpack_t *uc) {
-	int carry = (uc->bits & 1) != 0;
-	uc->bits >>= 1;
-	if (uc->bits == 0) { // getnextlwd
-		uc->bits = READ_BE_UINT32(uc->src); uc->src -= 4;
-		uc->crc ^= uc->bits;
-		carry = (uc->bits & 1) != 0;
-		uc->bits = (1 << 31) | (uc->bits >> 1);
+/* indexed by the next 3 bits of the stream */
+static const struct {
+	uint8_t op;
+	uint8_t len;
+} kOpcodes[8] = {
+	{ kOpLiteral3, 2 }, { kOpLiteral3, 2 },
+	{ kOpReference8, 2 }, { kOpReference8, 2 },
+	{ kOpReference9, 3 }, { kOpReference10, 3 },
+	{ kOpReference12, 3 }, { kOpLiteral8, 3 }
+};
+
+static uint32_t reverseBits32(uint32_t x) {
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+	return __builtin_bswap32(x);
+}
+
+/* the stream is consumed lsb first, store the words bit reversed so fields can be read msb first */
+static void refill(struct unpack_t *uc) { // getnextlwd
+	const uint32_t word = READ_BE_UINT32(uc->src); uc->src -= 4;
+	uc->crc ^= word;
+	uc->bits |= (uint64_t)reverseBits32(word) << (32 - uc->count);
+	uc->count += 32;
+}
+
+/* a word is only loaded when one of its bits is needed, this keeps the crc identical to the original routine */
+static inline uint32_t getBits(struct unpack_t *uc, int count) { // rdd1bits
+	if (uc->count < count) {
+		refill(uc);
 	}
-	return carry;
+	const uint32_t value = (uint32_t)(uc->bits >> (64 - count));
+	uc->bits <<= count;
+	uc->count -= count;
+	return value;
 }
 
-static int getBits(struct unpack_t *uc, int count) { // rdd1bits
-	int bits = 0;
-	for (int i = 0; i < count; ++i) {
-		bits |= nextBit(uc) << (count - 1 - i);
+static inline uint32_t peekBits(struct unpack_t *uc, int count) {
+	if (uc->count < count) {
+		refill(uc);
 	}
-	return bits;
+	return (uint32_t)(uc->bits >> (64 - count));
 }
 
 static void copyLiteral(struct unpack_t *uc, int bitsCount, int len) { // getd3chr
@@ -36,12 +63,33 @@ static void copyLiteral(struct unpack_t *uc, int bitsCount, int len) { // getd3c
 		count += uc->size;
 		uc->size = 0;
 	}
-	for (int i = 0; i < count; ++i) {
-		*(uc->dst - i) = (uint8_t)getBits(uc, 8);
+	uint8_t *dst = uc->dst;
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		if (uc->count < 32) {
+			refill(uc);
+		}
+		const uint32_t value = (uint32_t)(uc->bits >> 32);
+		uc->bits <<= 32;
+		uc->count -= 32;
+		dst[-i]     = value >> 24;
+		dst[-i - 1] = value >> 16;
+		dst[-i - 2] = value >> 8;
+		dst[-i - 3] = value;
+	}
+	for (; i < count; ++i) {
+		dst[-i] = (uint8_t)getBits(uc, 8);
 	}
 	uc->dst -= count;
 }
 
+/* original byte by byte copy of the references, for comparing the block copies in --bench */
+static int _unpackByteCopy;
+
+void setUnpackByteCopy(int enabled) {
+	_unpackByteCopy = enabled;
+}
+
 static void copyReference(struct unpack_t *uc, int bitsCount, int count) { // copyd3bytes
 	uc->size -= count;
 	if (uc->size < 0) {
@@ -49,46 +97,122 @@ static void copyReference(struct unpack_t *uc, int bitsCount, int count) { // co
 		uc->size = 0;
 	}
 	const int offset = getBits(uc, bitsCount);
-	for (int i = 0; i < count; ++i) {
-		*(uc->dst - i) = *(uc->dst - i + offset);
+	if (_unpackByteCopy) {
+		for (int i = 0; i < count; ++i) {
+			*(uc->dst - i) = *(uc->dst - i + offset);
+		}
+		uc->dst -= count;
+		return;
 	}
-	uc->dst -= count;
+	/* bytes are copied backwards, dst[-i] = dst[offset - i] */
+	uint8_t *dst = uc->dst - count + 1;
+	if (offset >= count) {
+		memcpy(dst, dst + offset, count);
+	} else if (offset == 1) {
+		memset(dst, uc->dst[1], count);
+	} else if (offset != 0) {
+		/* overlapping, copy in chunks of 'offset' bytes starting from the end */
+		uint8_t *p = uc->dst + 1;
+		while (count > 0) {
+			const int len = (count < offset) ? count : offset;
+			p -= len;
+			memcpy(p, p + offset, len);
+			count -= len;
+		}
+	}
+	uc->dst = dst - 1;
 }
 
 uint32_t bytekiller_unpack(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize) {
+	struct tracescope_t scope;
+	beginTraceScope(&scope, "unpack", "bytekiller_unpack");
 	struct unpack_t uc;
 	uc.src = src + srcSize - 4;
 	uc.size = READ_BE_UINT32(uc.src); uc.src -= 4;
 	if (uc.size > dstSize) {
+		endTraceScope(&scope);
 		return 0;
 	}
 	uc.dst = dst + uc.size - 1;
 	uc.crc = READ_BE_UINT32(uc.src); uc.src -= 4;
-	uc.bits = READ_BE_UINT32(uc.src); uc.src -= 4;
-	uc.crc ^= uc.bits;
+	/* the first word is terminated by its highest set bit */
+	const uint32_t word = READ_BE_UINT32(uc.src); uc.src -= 4;
+	uc.crc ^= word;
+	uc.count = (word == 0) ? 0 : 31 - __builtin_clz(word);
+	uc.bits = (uc.count == 0) ? 0 : ((uint64_t)reverseBits32(word) << 32) & (~0ULL << (64 - uc.count));
+	const int size = uc.size;
+	uint32_t ops[kOpCount] = { 0 };
+	do {
+		const int code = peekBits(&uc, 3);
+		++ops[kOpcodes[code].op];
+		uc.bits <<= kOpcodes[code].len;
+		uc.count -= kOpcodes[code].len;
+		switch (kOpcodes[code].op) {
+		case kOpLiteral3:
+			copyLiteral(&uc, 3, 0);
+			break;
+		case kOpReference8:
+			copyReference(&uc, 8, 2);
+			break;
+		case kOpLiteral8:
+			copyLiteral(&uc, 8, 8);
+			break;
+		case kOpReference12:
+			copyReference(&uc, 12, getBits(&uc, 8) + 1);
+			break;
+		case kOpReference10:
+			copyReference(&uc, 10, 4);
+			break;
+		case kOpReference9:
+			copyReference(&uc, 9, 3);
+			break;
+		}
+	} while (uc.size > 0);
+	/* the words are read backwards from the end of the stream */
+	countUnpack(ops, src + srcSize - (uc.src + 4), size);
+	addTraceArg(&scope, "packed", src + srcSize - (uc.src + 4));
+	addTraceArg(&scope, "unpacked", size);
+	endTraceScope(&scope);
+	return uc.crc;
+}
+
+int decodeRLE(const uint8_t *src, uint8_t *dst) {
+	int uncompressedSize = 0;
+	const uint16_t compressedSize = READ_BE_UINT16(src) & 0x7FFF; src += 2;
+	const uint8_t *src_end = src + compressedSize;
 	do {
-		if (!nextBit(&uc)) {
-			if (!nextBit(&uc)) {
-				copyLiteral(&uc, 3, 0);
-			} else {
-				copyReference(&uc, 8, 2);
+		int8_t code = *src++;
+		if (code < 0) {
+			code = -code;
+			for (int i = 0; i < code + 1; ++i) {
+				*dst++ = *src;
 			}
+			++src;
 		} else {
-			switch (getBits(&uc, 2)) {
-			case 3:
-				copyLiteral(&uc, 8, 8);
-				break;
-			case 2:
-				copyReference(&uc, 12, getBits(&uc, 8) + 1);
-				break;
-			case 1:
-				copyReference(&uc, 10, 4);
-				break;
-			case 0:
-				copyReference(&uc, 9, 3);
-				break;
+			for (int i = 0; i < code + 1; ++i) {
+				*dst++ = *src++;
 			}
 		}
-	} while (uc.size > 0);
-	return uc.crc;
+		uncompressedSize += code + 1;
+	} while (src < src_end);
+	assert(src == src_end);
+	countRLE(compressedSize + 2, uncompressedSize);
+	return uncompressedSize;
+}
+
+int getRLESize(const uint8_t *src) {
+	int uncompressedSize = 0;
+	const uint16_t compressedSize = READ_BE_UINT16(src) & 0x7FFF; src += 2;
+	const uint8_t *src_end = src + compressedSize;
+	do {
+		int8_t code = *src++;
+		if (code < 0) {
+			code = -code;
+			++src;
+		} else {
+			src += code + 1;
+		}
+		uncompressedSize += code + 1;
+	} while (src < src_end);
+	return uncompressedSize;
 }
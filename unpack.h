@@ -4,6 +4,23 @@
 
 #include "intern.h"
 
+/* bytekiller opcodes */
+enum {
+	kOpLiteral3,    /* 00 */
+	kOpReference8,  /* 01 */
+	kOpReference9,  /* 100 */
+	kOpReference10, /* 101 */
+	kOpReference12, /* 110 */
+	kOpLiteral8,    /* 111 */
+	kOpCount
+};
+
 uint32_t bytekiller_unpack(uint8_t *dst, int dstSize, const uint8_t *src, int srcSize);
+/* copies the references one byte at a time as the original routine, for benchmarking */
+void setUnpackByteCopy(int enabled);
+/* SGD shapes, returns the number of bytes written to 'dst' */
+int decodeRLE(const uint8_t *src, uint8_t *dst);
+/* number of bytes written by decodeRLE */
+int getRLESize(const uint8_t *src);
 
 #endif /* UNPACK_H__ */
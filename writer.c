@@ -0,0 +1,287 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+#include "writer.h"
+
+#define MAX_WRITER_THREADS 16
+#define WRITER_BATCH 16
+#define WRITER_QUEUE_SIZE (16 << 20)
+
+struct writenode_t {
+	struct writenode_t *next;
+	uint8_t *data;
+	int size;
+	bool skipSame;
+	char name[128];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty, notFull, drained;
+	struct writenode_t *head, *tail;
+	uint32_t queued, queuedBytes;
+	uint32_t pending; /* queued or being written */
+	uint32_t maxBytes;
+	bool stopping, sync;
+	int threads;
+	pthread_t tids[MAX_WRITER_THREADS];
+	struct writerstats_t stats;
+	uint64_t stallUs, writeUs;
+} _writer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static uint64_t getTimeUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the content is known to be the same, only a missing or truncated file is rewritten */
+static bool isFileWritten(const char *filename, int size) {
+	struct stat st;
+	return stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size;
+}
+
+enum {
+	kWriteDone,
+	kWriteSkipped,
+	kWriteFailed
+};
+
+/* open, write and close, without going through a stdio buffer */
+/* a partly written file is removed, so it is neither skipped on the next run nor taken as an unchanged output */
+static int writeFile(const char *filename, const uint8_t *data, int size, bool skipSame) {
+	if (skipSame && isFileWritten(filename, size)) {
+		return kWriteSkipped;
+	}
+	int fd;
+	do {
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	} while (fd < 0 && errno == EINTR);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open '%s' (%s)\n", filename, strerror(errno));
+		return kWriteFailed;
+	}
+	int offset = 0;
+	while (offset < size) {
+		const ssize_t count = write(fd, data + offset, size - offset);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			break;
+		}
+		offset += count;
+	}
+	bool failed = offset < size;
+	int err = errno;
+	/* the data may only be flushed on close, EINTR leaves the descriptor closed */
+	if (close(fd) != 0 && errno != EINTR && !failed) {
+		failed = true;
+		err = errno;
+	}
+	if (failed) {
+		fprintf(stderr, "Unable to write '%s' (%s)\n", filename, strerror(err));
+		unlink(filename);
+		return kWriteFailed;
+	}
+	return kWriteDone;
+}
+
+/* each writer takes up to WRITER_BATCH files at once */
+static void *runWriter(void *arg) {
+	nameTraceThread("writer", (int)(intptr_t)arg);
+	pthread_mutex_lock(&_writer.lock);
+	while (1) {
+		while (!_writer.head && !_writer.stopping) {
+			pthread_cond_wait(&_writer.notEmpty, &_writer.lock);
+		}
+		struct writenode_t *batch = _writer.head;
+		if (!batch) {
+			break;
+		}
+		struct writenode_t *last = batch;
+		int count = 1;
+		uint32_t bytes = batch->size;
+		while (count < WRITER_BATCH && last->next) {
+			last = last->next;
+			bytes += last->size;
+			++count;
+		}
+		_writer.head = last->next;
+		if (!_writer.head) {
+			_writer.tail = 0;
+		}
+		last->next = 0;
+		_writer.queued -= count;
+		_writer.queuedBytes -= bytes;
+		pthread_cond_broadcast(&_writer.notFull);
+		pthread_mutex_unlock(&_writer.lock);
+
+		struct tracescope_t scope;
+		beginTraceScope(&scope, "writer", "write_files");
+		addTraceArg(&scope, "files", count);
+		addTraceArg(&scope, "bytes", bytes);
+		const uint64_t start = getTimeUs();
+		int written = 0, errors = 0;
+		uint32_t writtenBytes = 0;
+		while (batch) {
+			struct writenode_t *next = batch->next;
+			switch (writeFile(batch->name, batch->data, batch->size, batch->skipSame)) {
+			case kWriteDone:
+				++written;
+				writtenBytes += batch->size;
+				break;
+			case kWriteFailed:
+				++errors;
+				break;
+			}
+			free(batch->data);
+			free(batch);
+			batch = next;
+		}
+		const uint64_t elapsed = getTimeUs() - start;
+		endTraceScope(&scope);
+
+		pthread_mutex_lock(&_writer.lock);
+		_writer.stats.files += written;
+		_writer.stats.skipped += count - written - errors;
+		_writer.stats.errors += errors;
+		_writer.stats.bytes += writtenBytes;
+		_writer.writeUs += elapsed;
+		_writer.pending -= count;
+		if (_writer.pending == 0) {
+			pthread_cond_broadcast(&_writer.drained);
+		}
+	}
+	pthread_mutex_unlock(&_writer.lock);
+	return 0;
+}
+
+void startOutputWriters(int threads, uint32_t maxBytes, int sync) {
+	if (threads > MAX_WRITER_THREADS) {
+		threads = MAX_WRITER_THREADS;
+	}
+	pthread_mutex_lock(&_writer.lock);
+	const bool started = _writer.threads != 0;
+	if (!started) {
+		memset(&_writer.stats, 0, sizeof(_writer.stats));
+		_writer.stallUs = _writer.writeUs = 0;
+		_writer.maxBytes = maxBytes ? maxBytes : WRITER_QUEUE_SIZE;
+		_writer.sync = sync;
+		_writer.stopping = false;
+	}
+	pthread_mutex_unlock(&_writer.lock);
+	if (started) {
+		return;
+	}
+	for (int i = 0; i < threads; ++i) {
+		if (pthread_create(&_writer.tids[i], 0, runWriter, (void *)(intptr_t)i) != 0) {
+			break;
+		}
+		pthread_mutex_lock(&_writer.lock);
+		++_writer.threads;
+		pthread_mutex_unlock(&_writer.lock);
+	}
+}
+
+void flushOutputWriters(void) {
+	pthread_mutex_lock(&_writer.lock);
+	while (_writer.pending != 0) {
+		pthread_cond_wait(&_writer.drained, &_writer.lock);
+	}
+	pthread_mutex_unlock(&_writer.lock);
+}
+
+void stopOutputWriters(void) {
+	pthread_mutex_lock(&_writer.lock);
+	const int threads = _writer.threads;
+	_writer.stopping = true;
+	pthread_cond_broadcast(&_writer.notEmpty);
+	pthread_mutex_unlock(&_writer.lock);
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(_writer.tids[i], 0);
+	}
+	pthread_mutex_lock(&_writer.lock);
+	_writer.threads = 0;
+	pthread_mutex_unlock(&_writer.lock);
+	if (threads != 0 && _writer.sync) {
+		sync();
+	}
+}
+
+void getOutputWriterStats(struct writerstats_t *stats) {
+	pthread_mutex_lock(&_writer.lock);
+	*stats = _writer.stats;
+	stats->stallMs = _writer.stallUs / 1000;
+	stats->writeMs = _writer.writeUs / 1000;
+	pthread_mutex_unlock(&_writer.lock);
+}
+
+static void writeFileInline(const char *filename, uint8_t *data, int size, bool skipSame) {
+	const int result = writeFile(filename, data, size, skipSame);
+	free(data);
+	pthread_mutex_lock(&_writer.lock);
+	_writer.stats.files += (result == kWriteDone);
+	_writer.stats.skipped += (result == kWriteSkipped);
+	_writer.stats.errors += (result == kWriteFailed);
+	if (result == kWriteDone) {
+		_writer.stats.bytes += size;
+	}
+	pthread_mutex_unlock(&_writer.lock);
+}
+
+void writeFileBuffer(const char *filename, uint8_t *data, int size, bool skipSame) {
+	struct writenode_t *node = (struct writenode_t *)malloc(sizeof(struct writenode_t));
+	if (!node) {
+		writeFileInline(filename, data, size, skipSame);
+		return;
+	}
+	node->next = 0;
+	node->data = data;
+	node->size = size;
+	node->skipSame = skipSame;
+	snprintf(node->name, sizeof(node->name), "%s", filename);
+
+	pthread_mutex_lock(&_writer.lock);
+	if (_writer.threads == 0 || _writer.stopping) {
+		pthread_mutex_unlock(&_writer.lock);
+		free(node);
+		writeFileInline(filename, data, size, skipSame);
+		return;
+	}
+	/* a file larger than the queue is queued once the queue is empty */
+	if (_writer.queuedBytes != 0 && _writer.queuedBytes + size > _writer.maxBytes) {
+		struct tracescope_t scope;
+		beginTraceScope(&scope, "writer", "writer_stall");
+		addTraceArg(&scope, "bytes", size);
+		const uint64_t start = getTimeUs();
+		do {
+			pthread_cond_wait(&_writer.notFull, &_writer.lock);
+		} while (_writer.queuedBytes != 0 && _writer.queuedBytes + size > _writer.maxBytes);
+		endTraceScope(&scope);
+		++_writer.stats.stalls;
+		_writer.stallUs += getTimeUs() - start;
+	}
+	if (_writer.tail) {
+		_writer.tail->next = node;
+	} else {
+		_writer.head = node;
+	}
+	_writer.tail = node;
+	++_writer.queued;
+	++_writer.pending;
+	_writer.queuedBytes += size;
+	if (_writer.stats.peakQueued < _writer.queued) {
+		_writer.stats.peakQueued = _writer.queued;
+	}
+	if (_writer.stats.peakQueuedBytes < _writer.queuedBytes) {
+		_writer.stats.peakQueuedBytes = _writer.queuedBytes;
+	}
+	pthread_cond_signal(&_writer.notEmpty);
+	pthread_mutex_unlock(&_writer.lock);
+}
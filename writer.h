@@ -0,0 +1,30 @@
+
+#ifndef WRITER_H__
+#define WRITER_H__
+
+#include "intern.h"
+
+struct writerstats_t {
+	uint32_t files; /* written */
+	uint32_t skipped; /* holding the same bytes, not rewritten */
+	uint32_t errors; /* not opened or not fully written */
+	uint32_t bytes; /* of the written files */
+	uint32_t peakQueued; /* files waiting for a writer */
+	uint32_t peakQueuedBytes;
+	uint32_t stalls; /* files queued after waiting for room */
+	uint32_t stallMs; /* time the decoding threads waited */
+	uint32_t writeMs; /* time the writer threads spent in the file calls */
+};
+
+/* the files are handed to 'threads' writer threads, queueing blocks while 'maxBytes' (0 for the default) are pending, 'sync' flushes the file systems once stopped */
+void startOutputWriters(int threads, uint32_t maxBytes, int sync);
+/* waits for the queued files to be written, the file names are relative to the current directory when written */
+void flushOutputWriters(void);
+void stopOutputWriters(void);
+void getOutputWriterStats(struct writerstats_t *stats);
+
+/* takes ownership of 'data', allocated with malloc, it is written inline if the writers are not started
+   'skipSame' tells the file was last written with the same content, it is then only rewritten if missing or of another size */
+void writeFileBuffer(const char *filename, uint8_t *data, int size, bool skipSame);
+
+#endif /* WRITER_H__ */